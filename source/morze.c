@@ -12,9 +12,9 @@
  */
 
 /* C generic */
-#include <stdio.h>        /* fprintf, printf */
+#include <stdio.h>        /* fprintf, printf, snprintf */
 #include <string.h>       /* strerror, memset */
-#include <stdlib.h>       /* exit */
+#include <stdlib.h>       /* exit, atoi */
 #include <errno.h>        /* errno */
 
 /* POSIX generic */
@@ -23,31 +23,61 @@
 #include <unistd.h>      /* fork, close, getppid, sleep, read, write */
 #include <fcntl.h>       /* O_RDONLY, O_WRONLY, O_CREAT, O_EXCL */
 #include <signal.h>      /* kill, sigaction */
+#include <time.h>        /* time */
 
-/* Signals defines */
-#define READY SIGRTMAX /* READY is send by receiver to get next bit */
-#define SEND1 SIGUSR1  /* SEND1 is send by sender if data is 1 */
-#define SEND0 SIGUSR2  /* SEND0 is send by sender if data is 0 */
-#define KILLER SIGINT  /* KILLER is used by both process for stop */
+/* Tools */
+#include "trace.h"       /* TRACE_INIT, TRACE_EVENT */
 
-int workfile;                /* working file */
-unsigned char byte;          /* byte buffer */
-int bit_num;                 /* counter of received/sent bits */
+/*
+ * Signals defines
+ * Data signals are real-time ones: they are queued, so bits of several
+ * senders are not merged when they arrive to daemon at the same time
+ */
+#define HELLO SIGRTMIN        /* HELLO is send by sender to open stream */
+#define SEND0 (SIGRTMIN + 1)  /* SEND0 is send by sender if data is 0 */
+#define SEND1 (SIGRTMIN + 2)  /* SEND1 is send by sender if data is 1 */
+#define FINISH (SIGRTMIN + 3) /* FINISH is send by sender after last byte */
+#define READY SIGRTMAX        /* READY is send by receiver to get next bit */
+#define KILLER SIGINT         /* KILLER is used by both process for stop */
+
+#define STREAMS 64            /* concurrent senders of daemon */
+#define PATHSIZE 4096         /* length of output file name */
+
+/**
+ * Stream of one sender
+ */
+struct stream
+{
+    int pid;                 /* pid of sender, 0 if stream is free */
+    int file;                /* output file */
+    unsigned char byte;      /* byte buffer */
+    int bit_num;             /* counter of received bits */
+    unsigned long bytes;     /* counter of written bytes */
+};
+
+int workfile;                /* working file of sender */
+unsigned char byte;          /* byte buffer of sender */
+int bit_num;                 /* counter of sent bits */
 
 int cpid;                    /* pid of child-sender */
-int ppid;                    /* pid of parent-receiver */
+int ppid;                    /* pid of receiver */
+
+struct stream streams[STREAMS];  /* streams of receiver */
+const char* target;          /* output file of single transfer */
+const char* prefix;          /* output prefix of daemon, NULL otherwise */
 
 /**
- * Sender error handler
+ * Sender handler
  * @param signo number of signal
  */
 void sender_handler(int signo)
 {
+    TRACE_EVENT(signal_received, signo);
     if (signo == KILLER)
     {
         /* Error message had been already written by receiver */
         close(workfile);
-        exit(EXIT_SUCCESS);
+        exit(EXIT_FAILURE);
     }
     if (signo == READY)
     {
@@ -55,9 +85,9 @@ void sender_handler(int signo)
         {
             errno = 0;
             /* Read new byte */
-            if (read(workfile, &byte, 1) == 0)
+            if (read(workfile, &byte, 1) <= 0)
             {
-                kill(ppid, KILLER);
+                kill(ppid, errno ? KILLER : FINISH);
                 close(workfile);
                 if (errno)
                 {
@@ -71,142 +101,361 @@ void sender_handler(int signo)
             bit_num = 0;
         }
         /* Send bit of data */
+        TRACE_EVENT(signal_sent, ((byte >> bit_num) % 2) ? SEND1 : SEND0);
         kill(ppid, ((byte >> bit_num++) % 2) ? SEND1 : SEND0);
     }
 }
 
 /**
- * Receiver error handler
+ * Finds stream of sender
+ * @param pid pid of sender, 0 for signal sent by kernel
+ * @return stream or NULL if sender is unknown
+ */
+struct stream* find_stream(int pid)
+{
+    int i;
+    if (pid == 0)
+        return NULL;
+    for (i = 0; i < STREAMS; i++)
+        if (streams[i].pid == pid)
+            return &streams[i];
+    return NULL;
+}
+
+/**
+ * Finds unused stream
+ * @return stream or NULL if all streams are busy
+ */
+struct stream* free_stream(void)
+{
+    int i;
+    for (i = 0; i < STREAMS; i++)
+        if (streams[i].pid == 0)
+            return &streams[i];
+    return NULL;
+}
+
+/**
+ * Closes stream and reports it
+ * @param stream stream to close
+ * @param status how stream is ended
+ */
+void close_stream(struct stream* stream, const char* status)
+{
+    close(stream->file);
+    TRACE_EVENT(stream_close, stream->pid);
+    if (prefix != NULL)
+        printf("Sender %d %s, %lu bytes received\n",
+            stream->pid, status, stream->bytes);
+    stream->pid = 0;
+}
+
+/**
+ * Opens stream for new sender
+ * @param pid pid of sender
+ * @return 0 on success, -1 on error
+ */
+int open_stream(int pid)
+{
+    char path[PATHSIZE];
+    struct stream* stream;
+
+    /* Repeated HELLO is just a lost handshake */
+    if (find_stream(pid) != NULL)
+        return 0;
+
+    stream = free_stream();
+    if (stream == NULL)
+    {
+        fprintf(stderr, "Receiver: too many senders, %d is rejected\n", pid);
+        return -1;
+    }
+
+    if (prefix != NULL)
+        snprintf(path, PATHSIZE, "%s.%d", prefix, pid);
+    else
+        snprintf(path, PATHSIZE, "%s", target);
+
+    stream->file = open(path, O_WRONLY|O_CREAT|O_EXCL, S_IRWXO|S_IRWXG|S_IRWXU);
+    if (stream->file == -1)
+    {
+        fprintf(stderr, "Error in creating file %s (Error %d: %s)\n",
+            path, errno, strerror(errno));
+        return -1;
+    }
+    stream->pid = pid;
+    stream->byte = 0;
+    stream->bit_num = 0;
+    stream->bytes = 0;
+    TRACE_EVENT(stream_open, pid);
+    if (prefix != NULL)
+        printf("Sender %d is connected, writing to %s\n", pid, path);
+    return 0;
+}
+
+/**
+ * Receiver handler, signals are demultiplexed by pid of sender
  * @param signo number of signal
+ * @param info information about sender
+ * @param context unused
  */
-void receiver_handler(int signo)
+void receiver_handler(int signo, siginfo_t* info, void* context)
 {
+    struct stream* stream;
+    int i;
+
+    TRACE_EVENT(signal_received, signo);
+
+    /* Error of one sender drops only its stream, KILLER from terminal
+       or from unknown process stops daemon */
+    stream = find_stream(info->si_pid);
+    if (signo == KILLER && prefix != NULL && stream != NULL)
+    {
+        close_stream(stream, "is failed");
+        return;
+    }
+
     if (signo == KILLER)
     {
-        close(workfile);
-        waitpid(cpid, NULL, 0);
-        printf("Finished!\n");
+        for (i = 0; i < STREAMS; i++)
+            if (streams[i].pid != 0)
+            {
+                if (prefix != NULL)
+                    kill(streams[i].pid, KILLER);
+                close_stream(&streams[i], "is interrupted");
+            }
+        if (prefix == NULL)
+        {
+            waitpid(cpid, NULL, 0);
+            printf("Finished!\n");
+        }
         exit(EXIT_SUCCESS);
     }
+
+    /* Handshake */
+    if (signo == HELLO)
+    {
+        if (open_stream(info->si_pid) == -1)
+        {
+            kill(info->si_pid, KILLER);
+            if (prefix == NULL)
+                exit(EXIT_FAILURE);
+            return;
+        }
+        kill(info->si_pid, READY);
+        return;
+    }
+
+    if (stream == NULL)
+        return;
+
+    if (signo == FINISH)
+    {
+        close_stream(stream, "is finished");
+        if (prefix == NULL)
+        {
+            waitpid(cpid, NULL, 0);
+            printf("Finished!\n");
+            exit(EXIT_SUCCESS);
+        }
+        return;
+    }
+
     /* Append byte */
     if ((signo == SEND1) || (signo == SEND0))
     {
-        byte += ((signo == SEND1) << bit_num++);
-        if (bit_num == 8) /* Byte is completed */
+        stream->byte += ((signo == SEND1) << stream->bit_num++);
+        if (stream->bit_num == 8) /* Byte is completed */
         {
-            if (write(workfile, &byte, 1) == -1)
+            if (write(stream->file, &stream->byte, 1) == -1)
             {
                 fprintf(stderr,
                     "Receiver: error in writing to file (Error %d: %s)\n",
                      errno, strerror(errno));
-                kill(cpid, KILLER);
-                kill(ppid, KILLER);
+                kill(stream->pid, KILLER);
+                close_stream(stream, "is dropped");
+                if (prefix == NULL)
+                    exit(EXIT_FAILURE);
+                return;
             }
-            byte = 0;
-            bit_num = 0;
+            stream->byte = 0;
+            stream->bit_num = 0;
+            stream->bytes++;
         }
         /* Ask for next bit */
-        kill(cpid, READY);
+        TRACE_EVENT(signal_sent, READY);
+        kill(stream->pid, READY);
     }
 }
 
 /**
- * Entry point
- * @param argc
- * @param argv
+ * Sets handler for all signals of protocol
+ * @param new_action action with filled handler
+ * @param mask signals blocked during handling
  */
-int main(int argc, char** argv)
+void set_handlers(struct sigaction* new_action, const sigset_t* mask)
+{
+    new_action->sa_mask = *mask;
+    sigaction(KILLER, new_action, NULL);
+    sigaction(HELLO, new_action, NULL);
+    sigaction(READY, new_action, NULL);
+    sigaction(SEND0, new_action, NULL);
+    sigaction(SEND1, new_action, NULL);
+    sigaction(FINISH, new_action, NULL);
+}
+
+/**
+ * Sender: opens file, greets receiver and waits for READY signals
+ * @param file file to send
+ * @param mask signals blocked before start
+ * @param child sender is child of receiver
+ */
+void sender(const char* file, const sigset_t* mask, int child)
 {
     struct sigaction new_action;
-    struct sigaction old_action;
-    int cpid;
-    sigset_t mask;
 
-    if (argc != 3)
+    memset(&new_action, 0, sizeof(struct sigaction));
+    new_action.sa_handler = &sender_handler;
+    set_handlers(&new_action, mask);
+
+    workfile = open(file, O_RDONLY);
+    if (workfile == -1)
     {
-        fprintf(stderr, "Syntax error\n");
+        fprintf(stderr, "Error in opening file %s (Error %d: %s)\n",
+            file, errno, strerror(errno));
+        if (child)
+            kill(ppid, KILLER);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Fill bit_num to 8 for filling byte from file */
+    bit_num = 8;
+
+    /* Receiver answers to greeting with first READY */
+    if (kill(ppid, HELLO) == -1)
+    {
+        fprintf(stderr, "Error in connecting to receiver %d (Error %d: %s)\n",
+            ppid, errno, strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    /* Sender handling settings */
+    /* Unblocking signals and start */
+    sigprocmask(SIG_UNBLOCK, mask, NULL);
+
+    while(1)
+    {
+        sleep(10);
+        /* Receiver may die without KILLER */
+        if (kill(ppid, 0) == -1)
+        {
+            fprintf(stderr, "Receiver %d is lost\n", ppid);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Receiver: handles signals of senders
+ * @param mask signals blocked before start
+ */
+void receiver(const sigset_t* mask)
+{
+    struct sigaction new_action;
+    time_t checked = time(NULL);
+    int i;
+
     memset(&new_action, 0, sizeof(struct sigaction));
-    new_action.sa_handler = &sender_handler;
+    new_action.sa_sigaction = &receiver_handler;
+    new_action.sa_flags = SA_SIGINFO;
+    set_handlers(&new_action, mask);
+
+    sigprocmask(SIG_UNBLOCK, mask, NULL);
 
-    sigaction(KILLER, &new_action, &old_action);
-    sigaction(READY, &new_action, &old_action);
-    sigaction(SEND0, &new_action, &old_action);
-    sigaction(SEND1, &new_action, &old_action);
+    while(1)
+    {
+        sleep(1);
+        if (prefix == NULL || time(NULL) == checked)
+            continue;
+
+        /* Streams of senders died without FINISH are closed */
+        checked = time(NULL);
+        sigprocmask(SIG_BLOCK, mask, NULL);
+        for (i = 0; i < STREAMS; i++)
+            if (streams[i].pid != 0 && kill(streams[i].pid, 0) == -1)
+                close_stream(&streams[i], "is lost");
+        sigprocmask(SIG_UNBLOCK, mask, NULL);
+    }
+}
+
+/**
+ * Entry point
+ * Usage: morze <source> <destination>  - copy file
+ *        morze -d <prefix>             - receiver daemon,
+ *                                        writes <prefix>.<pid of sender>
+ *        morze -s <pid> <source>       - send file to daemon
+ * @param argc
+ * @param argv
+ */
+int main(int argc, char** argv)
+{
+    sigset_t mask;
 
     sigemptyset(&mask);
+    sigaddset(&mask, KILLER);
+    sigaddset(&mask, HELLO);
     sigaddset(&mask, READY);
     sigaddset(&mask, SEND0);
     sigaddset(&mask, SEND1);
+    sigaddset(&mask, FINISH);
 
     /* Blocking all signals before start */
     sigprocmask(SIG_BLOCK, &mask, NULL);
 
-    cpid = fork();
-    if (cpid == -1)
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    TRACE_INIT("morze");
+
+    if (argc == 3 && !strcmp(argv[1], "-d"))
     {
-        fprintf(stderr, "Error in creating process (Error %d: %s)\n",
-            errno, strerror(errno));
-        exit(EXIT_SUCCESS);
+        prefix = argv[2];
+        printf("Receiver %d is ready\n", getpid());
+        receiver(&mask);
     }
-    if (cpid == 0)
-    {
-        /* CHILD is sender */
-        ppid = getppid();
-    /*    sleep(10); */
 
-        workfile = open(argv[1], O_RDONLY);
-        if (workfile == -1)
+    if (argc == 4 && !strcmp(argv[1], "-s"))
+    {
+        ppid = atoi(argv[2]);
+        if (ppid <= 0)
         {
-            fprintf(stderr, "Error in opening file %s (Error %d: %s)\n",
-                argv[1], errno, strerror(errno));
-            kill(ppid, KILLER);
+            fprintf(stderr, "Syntax error\n");
             exit(EXIT_FAILURE);
         }
+        sender(argv[3], &mask, 0);
+    }
 
-        /* Fill bit_num to 8 for filling byte from file */
-        bit_num = 8;
+    if (argc != 3)
+    {
+        fprintf(stderr, "Syntax error\n");
+        exit(EXIT_FAILURE);
+    }
 
-        /* Unblocking signals and start */
-        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    target = argv[2];
+    ppid = getpid();
 
-        while(1) sleep(10);
+    cpid = fork();
+    if (cpid == -1)
+    {
+        fprintf(stderr, "Error in creating process (Error %d: %s)\n",
+            errno, strerror(errno));
+        exit(EXIT_SUCCESS);
     }
-    else
+    if (cpid == 0)
     {
-        /* Parent is receiver */
-
-        /* Receiver handling settings */
-        memset(&new_action, 0, sizeof(struct sigaction));
-        new_action.sa_handler = &receiver_handler;
-
-        sigprocmask(SIG_UNBLOCK, &mask, NULL);
-        sigaction(KILLER, &new_action, &old_action);
-        sigaction(READY, &new_action, &old_action);
-        sigaction(SEND0, &new_action, &old_action);
-        sigaction(SEND1, &new_action, &old_action);
-
-        /* Write file */
-        workfile = open(argv[2], O_WRONLY|O_CREAT|O_EXCL, S_IRWXO|S_IRWXG|S_IRWXU);
-        if (workfile == -1)
-        {
-            fprintf(stderr, "Error in creating file %s (Error %d: %s)\n",
-                argv[2], errno, strerror(errno));
-            kill(cpid, KILLER);
-            exit(EXIT_FAILURE);
-        }
-
-        bit_num = 0;
-        byte = 0;
-
-        /* Radio. Live transmission. */
-        printf("Translation started...\n");
-        sleep(1);
-        kill(cpid, READY);
-
-        while(1) sleep(10);
+        /* CHILD is sender */
+        sender(argv[1], &mask, 1);
     }
+
+    /* Parent is receiver. Radio. Live transmission. */
+    printf("Translation started...\n");
+    receiver(&mask);
+    return 0;
 }
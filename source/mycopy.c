@@ -4,6 +4,10 @@
  * Copies file with its rwx mask
  * Copies symbol link destination
  * If -l flag is provided, creates new symlink
+ * If -r flag is provided, copies directory tree keeping hard links
+ * and symlinks
+ * If -v flag is provided, checks copied files by CRC32C, -m also writes
+ * checksums to manifest
  *
  * @author pikryukov
  *
@@ -14,20 +18,52 @@
  */
 
 /* C generic */
-#include <string.h>       /* strcmp, strcpy, strerror */
+#include <string.h>       /* strcmp, strcpy, strerror, strlen */
 #include <errno.h>        /* strerror, EINVAL, errno */
-#include <stdlib.h>       /* malloc, free */
-#include <stdio.h>        /* fprintf */
+#include <stdlib.h>       /* malloc, calloc, free */
+#include <stdio.h>        /* fprintf, fopen, fclose */
 
 #define _GNU_SOURCE
 
 /* POSIX generic */
-#include <sys/stat.h>    /* fstat, fchmod, lstat, chmod */
-#include <unistd.h>      /* readlink, symlink, read, write, close */
-#include <fcntl.h>       /* O_RDONLY, O_WRONLY, O_CREAT, O_EXCL */
+#include <sys/stat.h>    /* fstat, fchmod, lstat, chmod, mkdir, mknod */
+#include <unistd.h>      /* readlink, symlink, linkat, read, write, close,
+                            fsync, getopt */
+#include <fcntl.h>       /* O_RDONLY, O_WRONLY, O_CREAT, O_EXCL, AT_FDCWD,
+                            posix_fadvise */
+#include <dirent.h>      /* opendir, readdir, closedir */
+
+/* Tools */
+#include "trace.h"       /* TRACE_INIT, TRACE_BEGIN, TRACE_END, TRACE_EVENT */
 
 #define BUF_LEN 65536    /* copy buffer length */
-#define ADR_LEN 256      /* UNIX address length */
+#define INODES 1024      /* initial buckets of inode map */
+#define CRC32C_POLY 0x82F63B78   /* reflected Castagnoli polynomial */
+
+int verify = 0;          /* check copies by read back */
+FILE* manifest = NULL;   /* checksums of copies, NULL if not needed */
+
+/**
+ * Copied file with several hard links
+ */
+struct inode_entry
+{
+    dev_t dev;                   /* device of source */
+    ino_t ino;                   /* inode of source */
+    char* path;                  /* destination of first copy */
+    unsigned int crc;            /* checksum of first copy if verified */
+    struct inode_entry* next;    /* next entry in bucket */
+};
+
+/**
+ * Map (st_dev, st_ino) -> destination path
+ */
+struct inode_map
+{
+    struct inode_entry** buckets;
+    size_t size;                 /* number of buckets */
+    size_t count;                /* number of entries */
+};
 
 /**
  * Mask copy
@@ -47,6 +83,10 @@ int maskCopy(char* src, char* dst)
         return 1;
     }
 
+    /* Mode of symlink is not used, chmod would follow it */
+    if (S_ISLNK(p_info.st_mode))
+        return 0;
+
     result = chmod(dst, p_info.st_mode);
     if (result == -1)
     {
@@ -57,17 +97,154 @@ int maskCopy(char* src, char* dst)
     return 0;
 }
 
+/* Table of software CRC32C */
+unsigned int crc32cTable[256];
+
+/**
+ * Software CRC32C, byte per step
+ * @param crc current checksum
+ * @param buf data
+ * @param len length of data
+ * @return updated checksum
+ */
+unsigned int crc32cSoftware(unsigned int crc, const unsigned char* buf,
+    size_t len)
+{
+    while (len--)
+        crc = crc32cTable[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/**
+ * CRC32C by SSE4.2 instruction, 8 bytes per step
+ * @param crc current checksum
+ * @param buf data
+ * @param len length of data
+ * @return updated checksum
+ */
+__attribute__((target("sse4.2")))
+unsigned int crc32cHardware(unsigned int crc, const unsigned char* buf,
+    size_t len)
+{
+    unsigned long wide = crc;
+    while (len >= sizeof(unsigned long))
+    {
+        unsigned long word;
+        memcpy(&word, buf, sizeof(unsigned long));
+        wide = __builtin_ia32_crc32di(wide, word);
+        buf += sizeof(unsigned long);
+        len -= sizeof(unsigned long);
+    }
+    crc = (unsigned int)wide;
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *buf++);
+    return crc;
+}
+#endif
+
+/* CRC32C implementation chosen in runtime */
+unsigned int (*crc32cUpdate)(unsigned int, const unsigned char*, size_t)
+    = crc32cSoftware;
+
+/**
+ * Selects CRC32C implementation supported by CPU
+ */
+void crc32cInit()
+{
+    unsigned int i, j, crc;
+    for (i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        crc32cTable[i] = crc;
+    }
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32cUpdate = crc32cHardware;
+#endif
+}
+
+/**
+ * Reads file back from disk and checks its CRC32C
+ * @param dst destination filename
+ * @param d_dst descriptor of written destination
+ * @param expected checksum of source data
+ * @param buf read buffer of BUF_LEN bytes
+ * @return 0 on success
+ * @return 1 on error
+ */
+int verifyCopy(char* dst, int d_dst, unsigned int expected, char* buf)
+{
+    unsigned int crc = 0xFFFFFFFF;
+    int d_check;
+    ssize_t result;
+
+    /* Data is flushed, so clean pages can be dropped from cache */
+    if (fsync(d_dst) == -1)
+    {
+        fprintf(stderr, "Failed to sync '%s' (Error %d: %s)\n",
+            dst, errno, strerror(errno));
+        return 1;
+    }
+
+    d_check = open(dst, O_RDONLY);
+    if (d_check == -1)
+    {
+        fprintf(stderr, "Failed to open '%s' (Error %d: %s)\n",
+            dst, errno, strerror(errno));
+        return 1;
+    }
+    posix_fadvise(d_check, 0, 0, POSIX_FADV_DONTNEED);
+    posix_fadvise(d_check, 0, 0, POSIX_FADV_SEQUENTIAL);
+    TRACE_BEGIN(verify);
+
+    while ((result = read(d_check, buf, BUF_LEN)) != 0)
+    {
+        if (result == -1)
+        {
+            fprintf(stderr, "Failed to read from '%s' (Error %d: %s)\n",
+                dst, errno, strerror(errno));
+            close(d_check);
+            return 1;
+        }
+        crc = crc32cUpdate(crc, (unsigned char*)buf, result);
+    }
+    close(d_check);
+    TRACE_END(verify);
+
+    crc ^= 0xFFFFFFFF;
+    if (crc != expected)
+    {
+        fprintf(stderr, "Verification of '%s' failed: "
+            "checksum %08x, expected %08x\n", dst, crc, expected);
+        return 1;
+    }
+
+    if (manifest != NULL)
+        fprintf(manifest, "%08x  %s\n", crc, dst);
+    return 0;
+}
+
 /**
  * Usual file copy
+ * If verification is on, checksum is computed while data is in buffer
+ * and compared with checksum of destination read back from disk
  * @param src source filename
  * @param dst destination filename
+ * @param checksum verified checksum of copy, may be NULL
  * @return 0 on success
  * @return 1 on error
  */
-int justCopy(char* src, char* dst){
-    int result = 0;
+int justCopy(char* src, char* dst, unsigned int* checksum){
+    ssize_t result = 0;
+    ssize_t written;
     int d_dst, d_src;
     char* buf;
+    unsigned int crc = 0xFFFFFFFF;
 
     /* Source file processing */
     d_src = open(src, O_RDONLY);
@@ -79,7 +256,7 @@ int justCopy(char* src, char* dst){
     }
 
     /* Destination file processing */
-    d_dst = open(dst, O_WRONLY|O_CREAT|O_EXCL);
+    d_dst = open(dst, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
     if (d_dst == -1)
     {
         fprintf(stderr, "Failed to create '%s' (Error %d: %s)\n",
@@ -89,34 +266,50 @@ int justCopy(char* src, char* dst){
     }
 
     buf = (char*)malloc(BUF_LEN); /* Read buffer */
-    while (result = read(d_src, buf, BUF_LEN), result > 0)
+    TRACE_BEGIN(copy_file);
+    while ((result = read(d_src, buf, BUF_LEN)) != 0)
     {
         /* Check read errors */
         if (result == -1)
         {
             fprintf(stderr, "Failed to read from '%s' (Error %d: %s)\n",
                 src, errno, strerror(errno));
+            free(buf);
             close(d_src);
             close(d_dst);
             return 1;
         }
 
+        TRACE_EVENT(copy_chunk, result);
+        if (verify)
+            crc = crc32cUpdate(crc, (unsigned char*)buf, result);
+
         /* Write */
-        result = write(d_dst, buf, result);
-        if (result == -1)
+        for (written = 0; written < result; )
         {
-            fprintf(stderr,"Failed to write to '%s' (Error %d: %s)\n",
-                dst,errno,strerror(errno));
-            close(d_src);
-            close(d_dst);
-            return 1;
+            ssize_t part = write(d_dst, buf + written, result - written);
+            if (part == -1)
+            {
+                fprintf(stderr,"Failed to write to '%s' (Error %d: %s)\n",
+                    dst,errno,strerror(errno));
+                free(buf);
+                close(d_src);
+                close(d_dst);
+                return 1;
+            }
+            written += part;
         }
     }
+
+    TRACE_END(copy_file);
+    result = verify ? verifyCopy(dst, d_dst, crc ^ 0xFFFFFFFF, buf) : 0;
+    if (checksum != NULL)
+        *checksum = crc ^ 0xFFFFFFFF;
     free(buf);
 
     close(d_src);
     close(d_dst);
-    return 0;
+    return result;
 }
 
 /**
@@ -128,23 +321,49 @@ int justCopy(char* src, char* dst){
  */
 int linkCopy(char* src, char* dst){
     int result = 0;
+    struct stat p_info;
+    size_t size;
+    char* linkto;
 
-    /* Buffer to save link destination */
-    char linkto[ADR_LEN];
-    memset(linkto, 0, ADR_LEN);
-    result = readlink(src, linkto, ADR_LEN);
+    result = lstat(src, &p_info);
     if (result == -1)
     {
-        /* File is not a link, so we call justCopy */
-        if (errno == EINVAL)
-            return justCopy(src, dst);
         fprintf(stderr, "Link detection in '%s' failed: (Error %d: %s)\n",
             src, errno, strerror(errno));
         return 1;
     }
 
+    /* File is not a link, so we call justCopy */
+    if (!S_ISLNK(p_info.st_mode))
+        return justCopy(src, dst, NULL);
+
+    /*
+     * Buffer to save link destination is sized from st_size,
+     * but some file systems report 0, then buffer grows until
+     * the target fits
+     */
+    size = p_info.st_size > 0 ? p_info.st_size + 1 : BUF_LEN;
+    while (1)
+    {
+        linkto = (char*)malloc(size);
+        result = readlink(src, linkto, size);
+        if (result == -1)
+        {
+            fprintf(stderr, "Failed to read link '%s' (Error %d: %s)\n",
+                src, errno, strerror(errno));
+            free(linkto);
+            return 1;
+        }
+        if ((size_t)result < size)
+            break;
+        free(linkto);
+        size *= 2;
+    }
+    linkto[result] = '\0';
+
     /* Creating new symlink */
     result = symlink(linkto, dst);
+    free(linkto);
     if (result == -1)
     {
         fprintf(stderr, "Failed to create link in '%s' (Error %d: %s)\n",
@@ -154,6 +373,195 @@ int linkCopy(char* src, char* dst){
     return 0;
 }
 
+/**
+ * Finds already copied inode
+ * @param map inode map
+ * @param info stat of source
+ * @return entry or NULL if inode is not copied yet
+ */
+struct inode_entry* inodeFind(struct inode_map* map, struct stat* info)
+{
+    struct inode_entry* entry = map->buckets[(info->st_ino ^ info->st_dev) % map->size];
+    for (; entry != NULL; entry = entry->next)
+        if ((entry->ino == info->st_ino) && (entry->dev == info->st_dev))
+            return entry;
+    return NULL;
+}
+
+/**
+ * Remembers destination of copied inode, doubles buckets on overload
+ * @param map inode map
+ * @param info stat of source
+ * @param dst destination path
+ * @param crc checksum of copy
+ */
+void inodeAdd(struct inode_map* map, struct stat* info, char* dst,
+    unsigned int crc)
+{
+    struct inode_entry* entry;
+    size_t bucket;
+
+    if (map->count >= map->size)
+    {
+        struct inode_entry** old = map->buckets;
+        size_t size = map->size;
+        size_t i;
+
+        map->size *= 2;
+        map->buckets = (struct inode_entry**)
+            calloc(map->size, sizeof(struct inode_entry*));
+        for (i = 0; i < size; i++)
+            while (old[i] != NULL)
+            {
+                entry = old[i];
+                old[i] = entry->next;
+                bucket = (entry->ino ^ entry->dev) % map->size;
+                entry->next = map->buckets[bucket];
+                map->buckets[bucket] = entry;
+            }
+        free(old);
+    }
+
+    entry = (struct inode_entry*)malloc(sizeof(struct inode_entry));
+    entry->dev = info->st_dev;
+    entry->ino = info->st_ino;
+    entry->path = (char*)malloc(strlen(dst) + 1);
+    strcpy(entry->path, dst);
+    entry->crc = crc;
+    bucket = (entry->ino ^ entry->dev) % map->size;
+    entry->next = map->buckets[bucket];
+    map->buckets[bucket] = entry;
+    map->count++;
+}
+
+/**
+ * Frees inode map
+ * @param map inode map
+ */
+void inodeFree(struct inode_map* map)
+{
+    size_t i;
+    for (i = 0; i < map->size; i++)
+        while (map->buckets[i] != NULL)
+        {
+            struct inode_entry* entry = map->buckets[i];
+            map->buckets[i] = entry->next;
+            free(entry->path);
+            free(entry);
+        }
+    free(map->buckets);
+}
+
+/**
+ * Joins directory and name
+ * @param dir directory path
+ * @param name file name
+ * @return allocated path
+ */
+char* pathJoin(char* dir, char* name)
+{
+    char* path = (char*)malloc(strlen(dir) + strlen(name) + 2);
+    strcpy(path, dir);
+    strcat(path, "/");
+    strcat(path, name);
+    return path;
+}
+
+/**
+ * Tree copy: directories are recreated, symlinks are copied as links,
+ * files with several hard links are copied once and linked then
+ * @param src source path
+ * @param dst destination path
+ * @param map copied inodes
+ * @return 0 on success
+ * @return 1 if any entry has failed
+ */
+int treeCopy(char* src, char* dst, struct inode_map* map)
+{
+    struct stat p_info;
+    struct dirent* entry;
+    DIR* dir;
+    int result = 0;
+
+    if (lstat(src, &p_info) == -1)
+    {
+        fprintf(stderr, "Failed to stat '%s' (Error %d: %s)\n",
+            src, errno, strerror(errno));
+        return 1;
+    }
+
+    if (!S_ISDIR(p_info.st_mode))
+    {
+        struct inode_entry* first =
+            (p_info.st_nlink > 1) ? inodeFind(map, &p_info) : NULL;
+        unsigned int crc = 0;
+
+        /* Hard link to already copied inode, every name is in manifest */
+        if (first != NULL)
+        {
+            if (linkat(AT_FDCWD, first->path, AT_FDCWD, dst, 0) == -1)
+            {
+                fprintf(stderr, "Failed to link '%s' to '%s' (Error %d: %s)\n",
+                    dst, first->path, errno, strerror(errno));
+                return 1;
+            }
+            if ((manifest != NULL) && S_ISREG(p_info.st_mode))
+                fprintf(manifest, "%08x  %s\n", first->crc, dst);
+            TRACE_EVENT(hard_link, p_info.st_ino);
+            return 0;
+        }
+
+        if (S_ISLNK(p_info.st_mode))
+            result = linkCopy(src, dst);
+        else if (S_ISREG(p_info.st_mode))
+            result = justCopy(src, dst, &crc) || maskCopy(src, dst);
+        else if (mknod(dst, p_info.st_mode, p_info.st_rdev) == -1)
+        {
+            fprintf(stderr, "Failed to create '%s' (Error %d: %s)\n",
+                dst, errno, strerror(errno));
+            result = 1;
+        }
+
+        if ((result == 0) && (p_info.st_nlink > 1))
+            inodeAdd(map, &p_info, dst, crc);
+        return result;
+    }
+
+    /* Directory is writable until its content is copied */
+    if (mkdir(dst, S_IRWXU) == -1)
+    {
+        fprintf(stderr, "Failed to create '%s' (Error %d: %s)\n",
+            dst, errno, strerror(errno));
+        return 1;
+    }
+
+    dir = opendir(src);
+    if (dir == NULL)
+    {
+        fprintf(stderr, "Failed to open '%s' (Error %d: %s)\n",
+            src, errno, strerror(errno));
+        return 1;
+    }
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char* from;
+        char* to;
+
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+
+        from = pathJoin(src, entry->d_name);
+        to = pathJoin(dst, entry->d_name);
+        result |= treeCopy(from, to, map);
+        free(from);
+        free(to);
+    }
+    closedir(dir);
+
+    return maskCopy(src, dst) || result;
+}
+
 /**
  * Entry point
  * @param argc
@@ -164,26 +572,65 @@ int linkCopy(char* src, char* dst){
  */
 int main(int argc, char** argv)
 {
+    int links = 0;
+    int tree = 0;
+    int result;
+    int opt;
+
     errno = 0;
+    TRACE_INIT("mycopy");
+
+    while ((opt = getopt(argc, argv, "lrvm:")) != -1)
+        switch (opt)
+        {
+            case 'l': links = 1; break;
+            case 'r': tree = 1; break;
+            case 'm':
+                manifest = fopen(optarg, "w");
+                if (manifest == NULL)
+                {
+                    fprintf(stderr, "Failed to create '%s' (Error %d: %s)\n",
+                        optarg, errno, strerror(errno));
+                    return 1;
+                }
+                /* Fall through: manifest needs verification */
+            case 'v': verify = 1; break;
+            default:
+                fprintf(stderr,"Syntax error\n");
+                return -1;
+        }
 
-    /* Standard mode */
-    if (argc == 3)
+    if ((argc - optind != 2) || (links && tree))
     {
-        int result = justCopy(argv[1],argv[2]);
-        return result
-            ? result
-            : maskCopy(argv[1],argv[2]);
+        fprintf(stderr,"Syntax error\n");
+        return -1;
     }
+    argv += optind;
+
+    if (verify)
+        crc32cInit();
 
-    /* -l mode */
-    if ((argc == 4) && (strcmp(argv[1],"-l ")))
+    if (tree)
+    {
+        /* -r mode */
+        struct inode_map map;
+
+        map.size = INODES;
+        map.count = 0;
+        map.buckets = (struct inode_entry**)
+            calloc(map.size, sizeof(struct inode_entry*));
+        result = treeCopy(argv[0], argv[1], &map);
+        inodeFree(&map);
+    }
+    else
     {
-        int result = linkCopy(argv[2],argv[3]);
-        return result
-            ? result
-            : maskCopy(argv[2],argv[3]);
+        /* Standard and -l modes */
+        result = links ? linkCopy(argv[0], argv[1]) : justCopy(argv[0], argv[1], NULL);
+        if (result == 0)
+            result = maskCopy(argv[0], argv[1]);
     }
 
-    fprintf(stderr,"Syntax error");
-    return -1;
+    if (manifest != NULL)
+        fclose(manifest);
+    return result;
 }
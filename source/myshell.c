@@ -11,6 +11,8 @@
  * Copyright (C) Pavel Kryukov 2012 (remastering)
  */
 
+#define _GNU_SOURCE       /* splice, F_SETPIPE_SZ */
+
 /* C generic */
 #include <stdio.h>        /* fprintf, printf, fgets, stdin */
 #include <string.h>       /* strlen, strtok, strcpy, strncpy, strcmp, strerror */
@@ -19,9 +21,51 @@
 
 /* POSIX generic */
 #include <sys/wait.h>    /* waitpid */
-#include <unistd.h>      /* fork, pipe, close, dup2, execvp, read */
+#include <sys/stat.h>    /* stat */
+#include <unistd.h>      /* fork, pipe, close, dup2, execv, execvp, read */
+#include <signal.h>      /* signal */
+#include <poll.h>        /* poll */
+#include <time.h>        /* clock_gettime */
+
+/* Linux specific */
+#include <fcntl.h>       /* splice, F_SETPIPE_SZ */
+
+/* Tools */
+#include "trace.h"       /* TRACE_INIT, TRACE_BEGIN, TRACE_END, TRACE_EVENT */
 
 #define STDSIZE 256
+#define HASHSIZE 64      /* buckets of path cache */
+#define PIPESIZE 65536   /* default capacity of pipe */
+
+/**
+ * Command resolved through PATH
+ */
+struct path_entry
+{
+    char* name;
+    char* path;
+    size_t dir;                 /* index of directory in PATH */
+    struct path_entry* next;
+};
+
+/**
+ * Directory of PATH with its modification time
+ */
+struct path_dir
+{
+    char* name;
+    struct timespec mtime;
+};
+
+/* Path cache, like hash builtin of other shells */
+static struct path_entry* path_table[HASHSIZE];
+static struct path_dir* path_dirs = NULL;
+static size_t path_count = 0;
+static char* path_variable = NULL;     /* PATH of last check */
+
+/* Pipeline settings */
+static int pipe_size = 0;       /* capacity of pipes, 0 is default */
+static int profile = 0;         /* relays between stages are measuring */
 
 /**
  * Frees two-dimension array with NULL terminator
@@ -35,6 +79,372 @@ void char_free(char **array)
     free(array);
 }
 
+/**
+ * Hash of command name
+ * @param name command name
+ * @return bucket of path cache
+ */
+size_t path_hash(const char *name)
+{
+    size_t hash = 5381;
+    while (*name)
+        hash = hash * 33 + (unsigned char)*name++;
+    return hash % HASHSIZE;
+}
+
+/**
+ * Drops entries of path cache from given directory index
+ * @param first index of first changed directory, 0 drops everything
+ */
+void path_forget(size_t first)
+{
+    size_t i;
+    for (i = 0; i < HASHSIZE; i++)
+    {
+        struct path_entry** link = &path_table[i];
+        while (*link != NULL)
+        {
+            struct path_entry* entry = *link;
+            if (entry->dir < first)
+            {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+}
+
+/**
+ * Modification time of directory, zero if it does not exist
+ * @param name directory
+ * @return mtime
+ */
+struct timespec path_mtime(const char *name)
+{
+    struct stat info;
+    struct timespec none = { 0, 0 };
+    if (stat(name, &info) == -1)
+        return none;
+    return info.st_mtim;
+}
+
+/**
+ * Checks PATH and mtimes of its directories and drops stale entries:
+ * command could appear in changed directory before its own one,
+ * or could disappear from its own one
+ */
+void path_validate()
+{
+    const char* path = getenv("PATH");
+    size_t i, first;
+
+    if (path == NULL)
+        path = "/bin:/usr/bin";
+
+    if (path_variable == NULL || strcmp(path_variable, path))
+    {
+        const char* begin = path;
+        path_forget(0);
+        for (i = 0; i < path_count; i++)
+            free(path_dirs[i].name);
+        free(path_variable);
+        path_variable = malloc(strlen(path) + 1);
+        strcpy(path_variable, path);
+
+        path_count = 0;
+        while (1)
+        {
+            const char* end = strchr(begin, ':');
+            size_t length;
+            if (end == NULL)
+                end = begin + strlen(begin);
+            length = end - begin;
+
+            path_dirs = realloc(path_dirs,
+                (path_count + 1) * sizeof(struct path_dir));
+
+            /* Empty element is current directory */
+            path_dirs[path_count].name = malloc(length + 2);
+            if (length == 0)
+                strcpy(path_dirs[path_count].name, ".");
+            else
+            {
+                strncpy(path_dirs[path_count].name, begin, length);
+                path_dirs[path_count].name[length] = '\0';
+            }
+            path_dirs[path_count].mtime
+                = path_mtime(path_dirs[path_count].name);
+            path_count++;
+
+            if (*end == '\0')
+                break;
+            begin = end + 1;
+        }
+        return;
+    }
+
+    first = path_count;
+    for (i = 0; i < path_count; i++)
+    {
+        struct timespec mtime = path_mtime(path_dirs[i].name);
+        if (mtime.tv_sec != path_dirs[i].mtime.tv_sec
+            || mtime.tv_nsec != path_dirs[i].mtime.tv_nsec)
+        {
+            path_dirs[i].mtime = mtime;
+            if (first == path_count)
+                first = i;
+        }
+    }
+    if (first < path_count)
+        path_forget(first);
+}
+
+/**
+ * Resolves command through path cache, call path_validate before
+ * @param name command name
+ * @return absolute path, name itself if it has slash, NULL if not found
+ */
+const char* path_resolve(const char *name)
+{
+    struct path_entry* entry;
+    size_t bucket = path_hash(name);
+    size_t i;
+
+    /* Names with slash are not searched */
+    if (strchr(name, '/') != NULL)
+        return name;
+
+    for (entry = path_table[bucket]; entry != NULL; entry = entry->next)
+        if (!strcmp(entry->name, name))
+            return entry->path;
+
+    for (i = 0; i < path_count; i++)
+    {
+        struct stat info;
+        char* candidate = malloc(strlen(path_dirs[i].name)
+            + strlen(name) + 2);
+        sprintf(candidate, "%s/%s", path_dirs[i].name, name);
+
+        if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode)
+            && access(candidate, X_OK) == 0)
+        {
+            entry = malloc(sizeof(struct path_entry));
+            entry->name = malloc(strlen(name) + 1);
+            strcpy(entry->name, name);
+            entry->path = candidate;
+            entry->dir = i;
+            entry->next = path_table[bucket];
+            path_table[bucket] = entry;
+            return candidate;
+        }
+        free(candidate);
+    }
+    return NULL;
+}
+
+/**
+ * Builtin 'hash': prints path cache, 'hash -r' clears it
+ * @param argv arguments with NULL terminator
+ */
+void path_builtin(char **argv)
+{
+    size_t i;
+    struct path_entry* entry;
+
+    if (argv[1] != NULL && !strcmp(argv[1], "-r"))
+    {
+        path_forget(0);
+        return;
+    }
+
+    path_validate();
+    for (i = 1; argv[i] != NULL; i++)
+        if (path_resolve(argv[i]) == NULL)
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+
+    for (i = 0; i < HASHSIZE; i++)
+        for (entry = path_table[i]; entry != NULL; entry = entry->next)
+            printf("%s\t%s\n", entry->name, entry->path);
+}
+
+/**
+ * Builtin 'pipesize': capacity of pipes of next pipelines
+ * 'pipesize N' sets bytes, 'pipesize max' sets system maximum,
+ * 'pipesize default' returns kernel default, without argument prints it
+ * @param argv arguments with NULL terminator
+ */
+void pipesize_builtin(char **argv)
+{
+    int size;
+
+    if (argv[1] == NULL)
+    {
+        printf("[pipe size: %d]\n", pipe_size ? pipe_size : PIPESIZE);
+        return;
+    }
+
+    if (!strcmp(argv[1], "default"))
+        size = 0;
+    else if (!strcmp(argv[1], "max"))
+    {
+        FILE* file = fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (file == NULL || fscanf(file, "%d", &size) != 1)
+        {
+            fprintf(stderr, "Error in reading pipe-max-size (Error %d: %s)\n",
+                errno, strerror(errno));
+            if (file != NULL)
+                fclose(file);
+            return;
+        }
+        fclose(file);
+    }
+    else if ((size = atoi(argv[1])) <= 0)
+    {
+        fprintf(stderr, "pipesize: N, max or default is expected\n");
+        return;
+    }
+    pipe_size = size;
+}
+
+/**
+ * Builtin 'profile on|off': relays with statistics between stages
+ * @param argv arguments with NULL terminator
+ */
+void profile_builtin(char **argv)
+{
+    if (argv[1] != NULL && !strcmp(argv[1], "on"))
+        profile = 1;
+    else if (argv[1] != NULL && !strcmp(argv[1], "off"))
+        profile = 0;
+    else
+        printf("[profile: %s]\n", profile ? "on" : "off");
+}
+
+/**
+ * Runs builtin command
+ * @param argv arguments with NULL terminator
+ * @return 1 if command is builtin
+ */
+int builtin(char **argv)
+{
+    if (argv[0] == NULL)
+        return 0;
+    if (!strcmp(argv[0], "hash"))
+        path_builtin(argv);
+    else if (!strcmp(argv[0], "pipesize"))
+        pipesize_builtin(argv);
+    else if (!strcmp(argv[0], "profile"))
+        profile_builtin(argv);
+    else
+        return 0;
+    return 1;
+}
+
+/**
+ * Reads monotonic clock
+ * @return time in seconds
+ */
+double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Relay of profiled link: moves data between pipes by splice
+ * and reports throughput, time of waiting for input and time
+ * of stall on full output
+ * @param link number of link in pipeline
+ * @param from writing command
+ * @param to reading command
+ * @param in read end of pipe from writer
+ * @param out write end of pipe to reader
+ */
+void relay(int link, const char *from, const char *to, int in, int out)
+{
+    unsigned long bytes = 0;
+    double input_wait = 0;
+    double output_stall = 0;
+    double start = now_seconds();
+    double elapsed;
+    size_t chunk = pipe_size ? pipe_size : PIPESIZE;
+
+    /* Closed reader ends relay, writer gets SIGPIPE then */
+    signal(SIGPIPE, SIG_IGN);
+    TRACE_BEGIN(relay);
+
+    while (1)
+    {
+        ssize_t moved = splice(in, NULL, out, NULL, chunk,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0)
+        {
+            bytes += moved;
+            TRACE_COUNTER(relay_bytes, bytes);
+            continue;
+        }
+        if (moved == 0)
+            break;
+
+        if (errno == EAGAIN)
+        {
+            struct pollfd fd;
+            double begin = now_seconds();
+
+            /* Either input is empty or output is full */
+            fd.fd = in;
+            fd.events = POLLIN;
+            if (poll(&fd, 1, 0) == 0)
+            {
+                poll(&fd, 1, -1);
+                input_wait += now_seconds() - begin;
+            }
+            else
+            {
+                fd.fd = out;
+                fd.events = POLLOUT;
+                poll(&fd, 1, -1);
+                output_stall += now_seconds() - begin;
+            }
+        }
+        else if (errno != EINTR)
+        {
+            if (errno != EPIPE)
+                fprintf(stderr, "Error in relay %d (Error %d: %s)\n",
+                    link, errno, strerror(errno));
+            break;
+        }
+    }
+
+    TRACE_END(relay);
+    elapsed = now_seconds() - start;
+    fprintf(stderr, "[pipe %d '%s' | '%s': %lu bytes in %.3f s, "
+        "%.1f MB/s, input wait %.3f s, output stall %.3f s]\n",
+        link, from, to, bytes, elapsed,
+        elapsed > 0 ? bytes / elapsed / 1e6 : 0.0,
+        input_wait, output_stall);
+}
+
+/**
+ * Creates pipe of configured capacity
+ * @param fds ends of pipe
+ * @return 0 on success, -1 on error
+ */
+int make_pipe(int *fds)
+{
+    if (pipe(fds) == -1)
+        return -1;
+    if (pipe_size && fcntl(fds[1], F_SETPIPE_SZ, pipe_size) == -1)
+        fprintf(stderr, "Error in setting pipe size %d (Error %d: %s)\n",
+            pipe_size, errno, strerror(errno));
+    return 0;
+}
+
 /**
  * Parse string to string array with memory allocation
  * @param line parsed string
@@ -57,7 +467,7 @@ char** parser(char *line, char *dividers)
         array = (char**)realloc(array, (i + 1) * sizeof(char*));
 
         /* Copy token */
-        array[i] = (char*)malloc(strlen(token) * sizeof(char));
+        array[i] = (char*)malloc((strlen(token) + 1) * sizeof(char));
         strcpy(array[i], token);
 
         /* Next token */
@@ -88,16 +498,53 @@ int MyExec(char ***Cmd, int counter)
     int symbols = 0;
 
     int** pipes = (int**)malloc(sizeof(int*) * counter);    /* pipes */
+    int** relays = NULL;    /* pipes from relays to stages when profiling */
     int* pid = (int*)malloc(sizeof(int) * counter);   /* process ids */
+    int* relay_pid = (int*)malloc(sizeof(int) * counter);
+    const char** paths = (const char**)malloc(sizeof(char*) * counter);
+
+    /* What is created so far, cleanup releases only that */
+    int result = -1;
+    size_t piped = 0;       /* pipes between stages */
+    size_t relayed = 0;     /* pipes from relays */
+    size_t started = 0;     /* stage processes */
+    size_t relaying = 0;    /* relay processes */
+
+    TRACE_BEGIN(pipeline);
+
+    /* Commands are resolved once in parent, children use execv */
+    path_validate();
+    for (j = 0; j < counter; j++)
+        paths[j] = Cmd[j][0] == NULL ? NULL : path_resolve(Cmd[j][0]);
 
     for (j = 0; j < counter; j++)
     {
         pipes[j] = (int*)malloc(sizeof(int) * 2);
-        if (pipe(pipes[j]) == -1)
+        if (make_pipe(pipes[j]) == -1)
         {
             fprintf(stderr, "Error in creating %d pipe (Error %d: %s)\n",
                 (int)j + 1, errno, strerror(errno));
-            return -1;
+            free(pipes[j]);
+            goto cleanup;
+        }
+        piped++;
+    }
+
+    /* Every link between stages gets relay with its own pipe */
+    if (profile && counter > 1)
+    {
+        relays = (int**)malloc(sizeof(int*) * (counter - 1));
+        for (j = 0; j + 1 < counter; j++)
+        {
+            relays[j] = (int*)malloc(sizeof(int) * 2);
+            if (make_pipe(relays[j]) == -1)
+            {
+                fprintf(stderr, "Error in creating %d relay pipe "
+                    "(Error %d: %s)\n", (int)j + 1, errno, strerror(errno));
+                free(relays[j]);
+                goto cleanup;
+            }
+            relayed++;
         }
     }
 
@@ -109,9 +556,7 @@ int MyExec(char ***Cmd, int counter)
         {
             fprintf(stderr, "Error in creating process %s, (Error %d: %s)\n",
                 Cmd[j][0],errno, strerror(errno));
-            free(pid);
-            free(pipes);
-            return -1;
+            goto cleanup;
         }
         /* CHILD */
         if (pid[j] == 0)
@@ -120,9 +565,10 @@ int MyExec(char ***Cmd, int counter)
             /* Everyone except first one creates read pipe */
             if (j != 0)
             {
-                close(pipes[j-1][1]);
-                dup2(pipes[j-1][0],0);
-                close(pipes[j-1][0]);
+                int* input = relays != NULL ? relays[j-1] : pipes[j-1];
+                close(input[1]);
+                dup2(input[0],0);
+                close(input[0]);
             }
 
             /* Creating write pipe */
@@ -132,25 +578,62 @@ int MyExec(char ***Cmd, int counter)
 
             /* Close all unnessesary pipes */
             for (k = 0; k < counter; k++)
-                if ((k != j) && (k != j-1))
+                if ((k != j) && ((k != j-1) || (relays != NULL)))
                 {
                     close(pipes[k][0]);
                     close(pipes[k][1]);
                     free(pipes[k]);
                 }
+            for (k = 0; relays != NULL && k + 1 < counter; k++)
+                if (k != j-1)
+                {
+                    close(relays[k][0]);
+                    close(relays[k][1]);
+                }
 
-            if (execvp(Cmd[j][0], Cmd[j]) == -1);            /* выполнение */
+            /* Stale or missing path falls back to PATH search */
+            if (paths[j] != NULL)
+                execv(paths[j], Cmd[j]);
+            if (execvp(Cmd[j][0], Cmd[j]) == -1)            /* выполнение */
             {
                 fprintf(stderr, 
                     "Error in executing command %s (Error %d: %s)\n",
                     Cmd[j][0], errno, strerror(errno));
-                free(pid);                
-                free(pipes[j]);
-                free(pipes[j-1]);
-                free(pipes);
-                return -1;
+                exit(EXIT_FAILURE);
             }
         }
+        started++;
+        TRACE_EVENT(stage_spawn, pid[j]);
+    }
+
+    /* Relays between stages */
+    for (j = 0; relays != NULL && j + 1 < counter; j++)
+    {
+        relay_pid[j] = fork();
+        if (relay_pid[j] == -1)
+        {
+            fprintf(stderr, "Error in creating relay %d, (Error %d: %s)\n",
+                (int)j + 1, errno, strerror(errno));
+            goto cleanup;
+        }
+        if (relay_pid[j] == 0)
+        {
+            for (k = 0; k < counter; k++)
+            {
+                if (k != j)
+                    close(pipes[k][0]);
+                close(pipes[k][1]);
+            }
+            for (k = 0; k + 1 < counter; k++)
+            {
+                close(relays[k][0]);
+                if (k != j)
+                    close(relays[k][1]);
+            }
+            relay(j + 1, Cmd[j][0], Cmd[j + 1][0], pipes[j][0], relays[j][1]);
+            exit(EXIT_SUCCESS);
+        }
+        relaying++;
     }
 
     /*PARENT */
@@ -160,11 +643,18 @@ int MyExec(char ***Cmd, int counter)
     {
         close(pipes[k][0]);
         close(pipes[k][1]);
-        free(pipes[k]);
+        pipes[k][0] = pipes[k][1] = -1;
     }
 
     /* Close last pipe read end */
     close(pipes[counter-1][1]);
+    pipes[counter-1][1] = -1;
+    for (k = 0; k < relayed; k++)
+    {
+        close(relays[k][0]);
+        close(relays[k][1]);
+        relays[k][0] = relays[k][1] = -1;
+    }
 
     /* Reading from last pipe */
     while(readres = read(pipes[counter-1][0], &s, 1), readres > 0)
@@ -186,25 +676,48 @@ int MyExec(char ***Cmd, int counter)
 
     /* Error handler */
     if (readres == -1)
-    {
         fprintf(stderr, "Error during sending data to MyShell\n");
-        free(pid);
-        free(pipes);
-        return -1;
-    }
+    else
+        result = 0;
 
-    /* Close last pipe */
-    close(pipes[counter - 1][0]);
-    free(pipes[counter - 1]);
+cleanup:
+    /* Pipes left open are closed, so started processes see EOF */
+    for (k = 0; k < piped; k++)
+    {
+        if (pipes[k][0] != -1)
+            close(pipes[k][0]);
+        if (pipes[k][1] != -1)
+            close(pipes[k][1]);
+        free(pipes[k]);
+    }
+    for (k = 0; k < relayed; k++)
+    {
+        if (relays[k][0] != -1)
+            close(relays[k][0]);
+        if (relays[k][1] != -1)
+            close(relays[k][1]);
+        free(relays[k]);
+    }
 
     /* Wait for zombies */
-    for (j = 0; j < counter; j++)
+    for (j = 0; j < started; j++)
+    {
           waitpid(pid[j], NULL, 0);
-
-    printf("[symbols: %d]\n[words: %d]\n[lines: %d]\n", symbols, words, strings);
+          TRACE_EVENT(stage_exit, pid[j]);
+    }
+    for (j = 0; j < relaying; j++)
+          waitpid(relay_pid[j], NULL, 0);
+    TRACE_END(pipeline);
+
+    if (result == 0)
+        printf("[symbols: %d]\n[words: %d]\n[lines: %d]\n",
+            symbols, words, strings);
+    free(relays);
+    free(paths);
+    free(relay_pid);
     free(pid);
     free(pipes);
-    return 0;
+    return result;
 }
 
 /**
@@ -221,7 +734,8 @@ int main(int argc, char *argv[])
     char** Cmdstr = NULL;                  /* array of commands divided by | */
     char*** Cmd = (char***)malloc(sizeof(char**));  /* full pipeline */
     int counter = 0;
-    
+
+    TRACE_INIT("myshell");
     if (argc > 1)                        /* проверка на синтаксис */
     {
         printf("This program doesn't need any arguments\n");
@@ -236,8 +750,8 @@ int main(int argc, char *argv[])
     while(1)
     {
         printf("C:\\>");
-        fgets(Line, STDSIZE, stdin);
-        if (!strcmp(Line, "exit\n"))
+        fflush(stdout);
+        if (fgets(Line, STDSIZE, stdin) == NULL || !strcmp(Line, "exit\n"))
         {        
             free(Cmd);
             free(Line);
@@ -256,12 +770,15 @@ int main(int argc, char *argv[])
         }
 
         /* Exec */
-        MyExec(Cmd, counter);
+        if (counter == 1 && builtin(Cmd[0]))
+            ;
+        else if (counter > 0)
+            MyExec(Cmd, counter);
         
         /* Mem free */
-        char_free(Cmdstr);
         counter = 0;
         while (Cmdstr[counter] != NULL)
             char_free(Cmd[counter++]);
+        char_free(Cmdstr);
     }
 }
@@ -12,24 +12,445 @@
  */
 
 // C generic
-#include <cstdlib>     // exit
-#include <cstring>     // strerror
+#include <cstdlib>     // exit, posix_memalign, free
+#include <cstdio>      // vsnprintf
+#include <cstdarg>     // va_list
+#include <cmath>       // log, exp, sqrt, cos
+#include <cstring>     // strerror, strcmp
 #include <cerrno>      // errno
+#include <climits>     // UCHAR_MAX
+#include <stdint.h>    // uint32_t, int64_t
 
 // C++ generic
 #include <iostream>
 #include <iomanip>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <functional>
+#include <deque>
 #include <queue>
 #include <vector>
+#include <new>
 
 // POSIX generic
-#include <unistd.h>     // sleep
+#include <unistd.h>     // sleep, syscall, write
+#include <time.h>       // clock_gettime
+#include <fcntl.h>      // open
+#include <dirent.h>     // opendir
+#include <sched.h>      // sched_setaffinity, sched_getcpu, CPU_SET
 
 // Pthreads
 #include <pthread.h>
 
-#define wTime 1        // wTime - average time for preparing document
-#define pTime 2        // pTime - average time for printing document
+// Linux specific
+#include <linux/futex.h>  // FUTEX_WAIT, FUTEX_WAKE
+#include <sys/syscall.h>  // SYS_futex
+
+// Tools
+#include "trace.h"        // TRACE_INIT, TRACE_BEGIN, TRACE_END, TRACE_EVENT
+
+#define wTime 1        // wTime - default time for preparing document
+#define pTime 2        // pTime - default time for printing document
+
+#define CACHE_LINE 64   // alignment to avoid false sharing
+#define SPIN_COUNT 100  // attempts before thread is parked
+#define LOG_RING 1024   // records in ring of thread, power of two
+#define LOG_RECORD 128  // size of log record
+#define TELEMETRY_PERIOD 10000  // default period of queue sampling, us
+
+/**
+ * Reads monotonic clock
+ * @return time in microseconds
+ */
+static inline int64_t Now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Reads monotonic clock
+ * @return time in nanoseconds
+ */
+static inline int64_t NowNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Base for classes with members aligned to cache line
+ */
+struct CacheAligned
+{
+    static void* operator new(size_t size)
+    {
+        void* result;
+        if (posix_memalign(&result, CACHE_LINE, size) != 0)
+            throw std::bad_alloc();
+        return result;
+    }
+    static void* operator new[](size_t size) { return operator new(size); }
+
+    // Not inlined: compiler would take free() as mismatched with new
+    static void operator delete(void* ptr) __attribute__((noinline))
+    {
+        free(ptr);
+    }
+    static void operator delete[](void* ptr) { operator delete(ptr); }
+};
+
+/**
+ * Small xorshift64* generator, one per thread
+ */
+class Random
+{
+private:
+    uint64_t state;
+public:
+    Random(uint64_t seed) : state(seed * 2654435761U
+        + UINT64_C(88172645463325252)) { }
+
+    inline uint64_t Next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * UINT64_C(2685821657736338717);
+    }
+
+    // Uniform in [0, 1)
+    inline double Uniform() { return (Next() >> 11) / 9007199254740992.0; }
+};
+
+/**
+ * Distribution of service time in seconds
+ *
+ * Syntax is const:T, exp:MEAN, lognormal:MEAN,SIGMA or empirical:FILE
+ * where FILE lists observed times, one per line
+ */
+class Distribution
+{
+public:
+    enum Type { CONSTANT, EXPONENTIAL, LOGNORMAL, EMPIRICAL };
+private:
+    Type type;
+    double mean;
+    double sigma;
+    std::vector<double> samples;
+public:
+    Distribution(double mean = 0) : type(CONSTANT), mean(mean), sigma(0) { }
+
+    // Parses description, returns false on syntax error
+    bool Parse(const char* text)
+    {
+        const char* colon = std::strchr(text, ':');
+        if (!colon)
+            return false;
+        std::string name(text, colon - text);
+        const char* value = colon + 1;
+        char* end;
+        samples.clear();
+        if (name == "empirical")
+        {
+            std::ifstream file(value);
+            double sample;
+            while (file >> sample)
+                if (sample >= 0)
+                    samples.push_back(sample);
+            if (samples.empty())
+            {
+                std::cerr << "Error in reading samples from " << value
+                    << std::endl;
+                return false;
+            }
+            type = EMPIRICAL;
+            mean = 0;
+            for (size_t i = 0; i < samples.size(); ++i)
+                mean += samples[i] / samples.size();
+            return true;
+        }
+
+        mean = strtod(value, &end);
+        if (end == value || mean < 0)
+            return false;
+        if (name == "const" && *end == '\0')
+            type = CONSTANT;
+        else if (name == "exp" && *end == '\0')
+            type = EXPONENTIAL;
+        else if (name == "lognormal" && *end == ',')
+        {
+            type = LOGNORMAL;
+            sigma = strtod(end + 1, &end);
+            if (*end != '\0' || sigma < 0 || mean == 0)
+                return false;
+        }
+        else
+            return false;
+        return true;
+    }
+
+    inline double Mean() const { return mean; }
+
+    // Draws next time
+    double Sample(Random& random) const
+    {
+        switch (type)
+        {
+        case EXPONENTIAL:
+            return -mean * std::log(1.0 - random.Uniform());
+        case LOGNORMAL:
+        {
+            // Box-Muller, mu is chosen to keep the mean
+            double u = 1.0 - random.Uniform();
+            double normal = std::sqrt(-2.0 * std::log(u))
+                * std::cos(2.0 * M_PI * random.Uniform());
+            return std::exp(std::log(mean) - sigma * sigma / 2
+                + sigma * normal);
+        }
+        case EMPIRICAL:
+            return samples[random.Next() % samples.size()];
+        default:
+            return mean;
+        }
+    }
+};
+
+/**
+ * Sleeps for given time
+ * @param seconds time, fractional part is respected
+ */
+static void Pause(double seconds)
+{
+    if (seconds <= 0)
+        return;
+    timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+/**
+ * CPUs of NUMA nodes read from sysfs
+ *
+ * Machine without node information is one node with all online CPUs
+ */
+class Topology
+{
+private:
+    std::vector<std::vector<int> > nodes;
+public:
+    // Parses list like "0-3,8,10-11", returns false on syntax error
+    static bool ParseList(const char* text, std::vector<int>& result)
+    {
+        result.clear();
+        while (*text && *text != '\n')
+        {
+            char* end;
+            long first = strtol(text, &end, 10);
+            long last = first;
+            if (end == text || first < 0)
+                return false;
+            if (*end == '-')
+            {
+                text = end + 1;
+                last = strtol(text, &end, 10);
+                if (end == text || last < first)
+                    return false;
+            }
+            for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+                result.push_back(cpu);
+            text = *end == ',' ? end + 1 : end;
+            if (end == text && *text && *text != '\n')
+                return false;
+        }
+        return true;
+    }
+
+    Topology()
+    {
+        DIR* dir = opendir("/sys/devices/system/node");
+        struct dirent* entry;
+        while (dir && (entry = readdir(dir)) != NULL)
+        {
+            int node;
+            char tail;
+            if (std::sscanf(entry->d_name, "node%d%c", &node, &tail) != 1)
+                continue;
+
+            std::string path = std::string("/sys/devices/system/node/")
+                + entry->d_name + "/cpulist";
+            std::ifstream file(path.c_str());
+            std::string line;
+            std::vector<int> cpus;
+            if (!std::getline(file, line) || !ParseList(line.c_str(), cpus)
+                || cpus.empty())
+                continue;
+            if (nodes.size() <= (size_t)node)
+                nodes.resize(node + 1);
+            nodes[node] = cpus;
+        }
+        if (dir)
+            closedir(dir);
+
+        // Nodes without CPUs, like memory-only ones, are not used
+        std::vector<std::vector<int> > used;
+        for (size_t i = 0; i < nodes.size(); ++i)
+            if (!nodes[i].empty())
+                used.push_back(nodes[i]);
+        nodes.swap(used);
+
+        if (nodes.empty())
+        {
+            long count = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+            nodes.resize(1);
+            for (long cpu = 0; cpu < count; ++cpu)
+                nodes[0].push_back(cpu);
+        }
+    }
+
+    // Leaves only allowed CPUs, returns false if none is left
+    bool Restrict(const std::vector<int>& allowed)
+    {
+        std::vector<std::vector<int> > result;
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            std::vector<int> cpus;
+            for (size_t j = 0; j < nodes[i].size(); ++j)
+                if (std::find(allowed.begin(), allowed.end(), nodes[i][j])
+                    != allowed.end())
+                    cpus.push_back(nodes[i][j]);
+            if (!cpus.empty())
+                result.push_back(cpus);
+        }
+        nodes.swap(result);
+        return !nodes.empty();
+    }
+
+    inline size_t Nodes() const { return nodes.size(); }
+    inline const std::vector<int>& Cpus(size_t node) const
+    {
+        return nodes[node];
+    }
+
+    // Node of CPU, the first one if CPU is not listed
+    size_t NodeOf(int cpu) const
+    {
+        for (size_t i = 0; i < nodes.size(); ++i)
+            if (std::find(nodes[i].begin(), nodes[i].end(), cpu)
+                != nodes[i].end())
+                return i;
+        return 0;
+    }
+};
+
+/**
+ * Placement of threads on CPUs
+ *
+ * none lets kernel place threads, compact pins every thread to its own
+ * CPU in list order, node gives worker i and printer i the same node
+ * and allows them any CPU of it
+ */
+class Placement
+{
+public:
+    enum Policy { NONE, COMPACT, NODE };
+private:
+    Policy policy;
+    const Topology* topology;
+    std::vector<int> cpus;          // all CPUs in node order
+
+    void Set(cpu_set_t& set, size_t node) const
+    {
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < topology->Cpus(node).size(); ++i)
+            CPU_SET(topology->Cpus(node)[i], &set);
+    }
+public:
+    Placement(Policy policy, const Topology* topology)
+        : policy(policy)
+        , topology(topology)
+    {
+        for (size_t i = 0; i < topology->Nodes(); ++i)
+            cpus.insert(cpus.end(), topology->Cpus(i).begin(),
+                topology->Cpus(i).end());
+    }
+
+    static bool ParsePolicy(const char* name, Policy& result)
+    {
+        for (int i = NONE; i <= NODE; ++i)
+            if (!std::strcmp(name, Name(static_cast<Policy>(i))))
+            {
+                result = static_cast<Policy>(i);
+                return true;
+            }
+        return false;
+    }
+
+    static const char* Name(Policy policy)
+    {
+        static const char* const names[] = { "none", "compact", "node" };
+        return names[policy];
+    }
+
+    inline Policy GetPolicy() const { return policy; }
+    inline size_t Cpus() const { return cpus.size(); }
+    inline size_t Nodes() const { return topology->Nodes(); }
+
+    // Node of thread, thread is numbered through workers and printers
+    size_t Node(size_t thread, size_t rank) const
+    {
+        if (policy != COMPACT)
+            return rank % Nodes();
+        return topology->NodeOf(cpus[thread % cpus.size()]);
+    }
+
+    // Node calling thread is running on now, for threads not pinned
+    inline size_t Current() const
+    {
+        int cpu = sched_getcpu();
+        return cpu == -1 ? 0 : topology->NodeOf(cpu);
+    }
+
+    // Sets affinity of thread being created, returns error code
+    int Apply(pthread_attr_t* attr, size_t thread, size_t rank) const
+    {
+        if (policy == NONE)
+            return 0;
+        cpu_set_t set;
+        if (policy == COMPACT)
+        {
+            CPU_ZERO(&set);
+            CPU_SET(cpus[thread % cpus.size()], &set);
+        }
+        else {
+            Set(set, Node(thread, rank));
+        }
+        return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    }
+
+    // Moves calling thread to node, so it touches memory of the node
+    // Returns previous affinity
+    cpu_set_t Enter(size_t node) const
+    {
+        cpu_set_t saved;
+        sched_getaffinity(0, sizeof(saved), &saved);
+        cpu_set_t set;
+        Set(set, node);
+        sched_setaffinity(0, sizeof(set), &set);
+        return saved;
+    }
+
+    void Leave(const cpu_set_t& saved) const
+    {
+        sched_setaffinity(0, sizeof(saved), &saved);
+    }
+};
 
 /**
  * Mutex class wrapper
@@ -71,62 +492,96 @@ public:
 
 /**
  * Printer use table
+ *
+ * Every printer counts its documents in its own cache line aligned
+ * column, columns are merged only in Print(). Counter of unfinished
+ * jobs is atomic.
  */
-class Table : private std::vector<std::vector<unsigned> >
+class Table : public CacheAligned
 {
 private:
     size_t N;   // amount of workers
     size_t M;   // amount of printers
     size_t K;   // amount of jobs of every worker
-    int counter;            // unfinished jobs
-    mutable Mutex mutex;
-    typedef typename std::vector<unsigned> Row;
-    typedef typename std::vector<std::vector<unsigned> > base;    
+    std::vector<unsigned*> columns;     // column of every printer
+    pthread_barrier_t localized;        // every printer has its column
+    int closed;                         // office is closed by one printer
+    int counter __attribute__((aligned(CACHE_LINE)));  // unfinished jobs
 public:
     // Constructor
     Table(size_t N, size_t M, size_t K) 
-        : base(N, Row(M, 0))
-        , N(N)
+        : N(N)
         , M(M)
         , K(K)
+        , columns(M)
+        , closed(0)
         , counter(N * K)
-    { }
+    {
+        for (size_t j = 0; j < M; ++j)
+            columns[j] = Column();
+        if (M != 0)
+            pthread_barrier_init(&localized, NULL, M);
+    }
+
+    // Allocates zeroed column
+    unsigned* Column() const
+    {
+        size_t size = (N * sizeof(unsigned) + CACHE_LINE - 1)
+            / CACHE_LINE * CACHE_LINE;
+        void* column;
+        if (posix_memalign(&column, CACHE_LINE, size) != 0)
+            throw std::bad_alloc();
+        std::memset(column, 0, size);
+        return reinterpret_cast<unsigned*>(column);
+    }
+
+    // Reallocates column of printer from its own thread before printing,
+    // so the column is placed on node of printer. Waits for all printers:
+    // the one which closes office reads every column
+    void Localize(int rank)
+    {
+        unsigned* column = Column();
+        free(columns[rank]);
+        columns[rank] = column;
+        pthread_barrier_wait(&localized);
+    }
     
     // Getters
+    inline size_t GetN() const { return N; }
     inline size_t GetK() const { return K; }
     inline size_t GetM() const { return M; }
     
-    // Mutexed addition
-    void Add(int rank, int document)
+    // Addition to printer's own column
+    // Returns amount of unfinished jobs
+    inline int Add(int rank, int document)
     {
-        mutex.Lock();
-        ++(*this)[document][rank];
-        --counter;
-        std::cout << "Printer " << rank << ": document from " << document << 
-            " (" << counter << " left)." << std::endl;
-        mutex.Unlock();
+        ++columns[rank][document];
+        return __sync_sub_and_fetch(&counter, 1);
     }
     
-    // If all jobs have been already finished, returns true (method is mutexed)
-    bool Check() const
+    // If all jobs have been already finished, returns true
+    inline bool Check() const
     {
-        mutex.Lock();
-        int result = counter > 0;
-        mutex.Unlock();
-        return result;
+        return __atomic_load_n(&counter, __ATOMIC_ACQUIRE) > 0;
     }
     
+    // Returns true for the only thread which closes office
+    inline bool Close()
+    {
+        return __sync_bool_compare_and_swap(&closed, 0, 1);
+    }
+
     // Print of table
     void Print() const
     {
-        Row sum(M, 0);
+        std::vector<unsigned> sum(M, 0);
         for (size_t i = 0; i < N; ++i)
         {
             std::cout << "| " << std::setw(2) << i << " ||";
             for (size_t j = 0; j < M; ++j)
             {
-                std::cout << " " << std::setw(2) << (*this)[i][j] << " |";
-                sum[j] += (*this)[i][j];
+                std::cout << " " << std::setw(2) << columns[j][i] << " |";
+                sum[j] += columns[j][i];
             }
             std::cout << std::endl;
         }
@@ -140,30 +595,115 @@ public:
 
         std::cout << std::endl;
     }
+
+    ~Table()
+    {
+        if (M != 0)
+            pthread_barrier_destroy(&localized);
+        for (size_t j = 0; j < M; ++j)
+            free(columns[j]);
+    }
 };
 
 /**
- * Document queue type
+ * Document queue interface
  */
-class Queue : private std::queue<int>
+class Queue
 {
-private:
+protected:
+    unsigned long contended;    // lock or slot was taken by other thread
+    unsigned long sleeps;       // thread had to sleep
+
+    inline void Count(unsigned long& counter)
+    {
+        __sync_fetch_and_add(&counter, 1);
+    }
+public:
+    Queue() : contended(0), sleeps(0) { }
+
+    virtual void Push(int what) = 0;
+    virtual int Pop() = 0;
+
+    // Pushes all documents, as many as fit at once in every step
+    virtual void PushBatch(const int* what, size_t count) = 0;
+
+    // Pops at least one and no more than max documents
+    virtual size_t PopBatch(int* result, size_t max) = 0;
+
+    /**
+     * Momentary state of queue
+     */
+    struct Gauge
+    {
+        size_t depth;           // documents in queue
+        unsigned producers;     // threads sleeping in push
+        unsigned consumers;     // threads sleeping in pop
+    };
+
+    // Approximate gauge, may be called from any thread
+    virtual Gauge Sample() = 0;
+
+    // Print of contention counters
+    virtual void Report(std::ostream& out) const
+    {
+        out << "[Contention: " << contended << " contended, "
+            << sleeps << " sleeps]" << std::endl;
+    }
+
+    virtual ~Queue() { }
+};
+
+/**
+ * Document queue with mutex and conditions
+ *
+ * Storage is std::queue or other container with the same interface
+ */
+template<typename Storage>
+class LockedQueue : public Queue, protected Storage
+{
+protected:
     size_t qSize;           // size of queue
     Mutex mutex;
     Cond doc_exist;
     Cond free_space_exist;
+    unsigned producers;     // sleeping on free_space_exist
+    unsigned consumers;     // sleeping on doc_exist
+
+    // Counted wait on condition
+    inline void Sleep(Cond& cond, unsigned& sleeping)
+    {
+        Count(sleeps);
+        __atomic_add_fetch(&sleeping, 1, __ATOMIC_RELAXED);
+        cond.Wait(mutex);
+        __atomic_sub_fetch(&sleeping, 1, __ATOMIC_RELAXED);
+    }
+
+    // Counted lock
+    inline void Lock()
+    {
+        if (mutex.TryLock() != 0)
+        {
+            Count(contended);
+            mutex.Lock();
+        }
+    }
 public:
-    Queue(size_t qSize)
-        : qSize(qSize)
+    LockedQueue(size_t qSize, const Storage& storage = Storage())
+        : Storage(storage)
+        , qSize(qSize)
+        , producers(0)
+        , consumers(0)
     { }
 
     // Muted push
     // If queue is not empty, broadcasts doc_exist
     void Push(int what)
     {
-        mutex.Lock();
+        Lock();
         while (qSize == this->size())
-            free_space_exist.Wait(mutex);
+        {
+            Sleep(free_space_exist, producers);
+        }
         
         this->push(what);
         
@@ -173,13 +713,40 @@ public:
         mutex.Unlock();
     }
 
+    // Muted push of several documents
+    void PushBatch(const int* what, size_t count)
+    {
+        while (count > 0)
+        {
+            Lock();
+            while (qSize == this->size())
+            {
+                Sleep(free_space_exist, producers);
+            }
+
+            bool was_empty = this->empty();
+            size_t n = std::min(count, qSize - this->size());
+            for (size_t i = 0; i < n; ++i)
+                this->push(what[i]);
+            what += n;
+            count -= n;
+
+            if (was_empty)
+                doc_exist.Broadcast();
+
+            mutex.Unlock();
+        }
+    }
+
     // Muted pop
     // If queue is not full, broadcasts free_space_exist
     int Pop() 
     {
-        mutex.Lock();
+        Lock();
         while(this->empty())
-            doc_exist.Wait(mutex);
+        {
+            Sleep(doc_exist, consumers);
+        }
 
         int result = this->front();
         this->pop();        
@@ -190,56 +757,1628 @@ public:
         mutex.Unlock();
         return result;
     }
-};
 
-/**
- * Task type
- */
-struct Task {
-    Table* table;
-    Queue* q;
-    int rank;
-    std::vector<Task*>& tasks;
-    
-    Task(Table* table, Queue* q, int rank, std::vector<Task*>& tasks)
-        : table(table)
-        , q(q)
-        , rank(rank)
-        , tasks(tasks)
-    { }
-};
+    // Muted pop of several documents
+    size_t PopBatch(int* result, size_t max)
+    {
+        Lock();
+        while(this->empty())
+        {
+            Sleep(doc_exist, consumers);
+        }
 
-/**
- * Worker thread
- * @param t pointer to task_t
- */
-void* worker(void* t)
-{
-    Task* task   = reinterpret_cast<Task*>(t);
-    Table* table = task->table;
-    Queue* q     = task->q;
-    size_t rank  = task->rank;
-    size_t K     = table->GetK();
-    std::cout << "Worker " << std::setw(3) << rank
-        << ": came to office" << std::endl;
+        bool was_full = this->size() == qSize;
+        size_t n = std::min(max, this->size());
+        for (size_t i = 0; i < n; ++i)
+        {
+            result[i] = this->front();
+            this->pop();
+        }
 
-    for (size_t sended = 0; sended < K; ++sended)
+        if (was_full)
+            free_space_exist.Broadcast();
+
+        mutex.Unlock();
+        return n;
+    }
+
+    Gauge Sample()
     {
-        sleep(wTime);
-        std::cout << "Worker " 
-            << std::setw(3) << rank 
-            << ": wrote " << sended << " document" << std::endl;
-        q->Push(rank);
+        mutex.Lock();
+        Gauge result = { this->size(),
+            __atomic_load_n(&producers, __ATOMIC_RELAXED),
+            __atomic_load_n(&consumers, __ATOMIC_RELAXED) };
+        mutex.Unlock();
+        return result;
     }
+};
 
-    std::cout << "Worker " << std::setw(3) << rank 
-        << ": went home" << std::endl;
-    pthread_exit(EXIT_SUCCESS);
-}
+typedef LockedQueue<std::queue<int> > MutexQueue;
 
 /**
- * Printer thread
- * @param t pointer to task_t
+ * Classes and deadlines of documents
+ *
+ * Class 0 is the most urgent one. Class of every document is drawn
+ * by weights, deadline is relative to time of writing, 0 is none.
+ */
+class Catalog
+{
+private:
+    std::vector<double> bounds;         // cumulative weights
+    std::vector<int64_t> relative;      // deadline of class, ns
+    std::vector<unsigned char> classes;     // by document
+    std::vector<int64_t> deadlines;         // by document, ns
+public:
+    Catalog(const std::vector<double>& weights,
+        const std::vector<double>& seconds, size_t documents)
+        : bounds(weights.size())
+        , relative(weights.size(), 0)
+        , classes(documents)
+        , deadlines(documents)
+    {
+        double total = 0;
+        for (size_t i = 0; i < weights.size(); ++i)
+            total += weights[i];
+        double sum = 0;
+        for (size_t i = 0; i < weights.size(); ++i)
+        {
+            sum += weights[i];
+            bounds[i] = sum / total;
+            if (i < seconds.size())
+                relative[i] = (int64_t)(seconds[i] * 1e9);
+        }
+    }
+
+    // Parses comma separated list of non-negative numbers
+    static bool ParseList(const char* text, std::vector<double>& result)
+    {
+        result.clear();
+        while (true)
+        {
+            char* end;
+            double value = strtod(text, &end);
+            if (end == text || value < 0)
+                return false;
+            result.push_back(value);
+            if (*end == '\0')
+                return result.size() <= UCHAR_MAX;
+            if (*end != ',')
+                return false;
+            text = end + 1;
+        }
+    }
+
+    // Draws class of document written at time now, ns
+    inline void Assign(int document, int64_t now, Random& random)
+    {
+        double u = random.Uniform();
+        size_t c = 0;
+        while (c + 1 < bounds.size() && u >= bounds[c])
+            ++c;
+        classes[document] = c;
+        deadlines[document] = relative[c] ? now + relative[c] : 0;
+    }
+
+    inline size_t Classes() const { return bounds.size(); }
+    inline bool HasDeadline(size_t c) const { return relative[c] != 0; }
+    inline size_t Class(int document) const { return classes[document]; }
+    inline int64_t Deadline(int document) const { return deadlines[document]; }
+};
+
+/**
+ * Storage of LockedQueue with priority classes
+ *
+ * Classes are served in strict order, FIFO inside a class without
+ * deadline and earliest deadline first inside a class with it.
+ * Push is O(1) or O(log n), pop is O(log n) plus scan of classes.
+ */
+class ClassStorage
+{
+private:
+    typedef std::pair<int64_t, int> Entry;  // deadline, document
+    typedef std::priority_queue<Entry, std::vector<Entry>,
+        std::greater<Entry> > Heap;
+
+    const Catalog* catalog;
+    std::vector<std::deque<int> > fifos;
+    std::vector<Heap> heaps;
+    size_t count;
+
+    // The most urgent non-empty class
+    size_t First() const
+    {
+        for (size_t c = 0; c + 1 < fifos.size(); ++c)
+            if (!fifos[c].empty() || !heaps[c].empty())
+                return c;
+        return fifos.size() - 1;
+    }
+public:
+    ClassStorage(const Catalog* catalog)
+        : catalog(catalog)
+        , fifos(catalog->Classes())
+        , heaps(catalog->Classes())
+        , count(0)
+    { }
+
+    void push(int what)
+    {
+        size_t c = catalog->Class(what);
+        if (catalog->HasDeadline(c))
+            heaps[c].push(Entry(catalog->Deadline(what), what));
+        else
+            fifos[c].push_back(what);
+        ++count;
+    }
+
+    int front() const
+    {
+        size_t c = First();
+        return heaps[c].empty() ? fifos[c].front() : heaps[c].top().second;
+    }
+
+    void pop()
+    {
+        size_t c = First();
+        if (heaps[c].empty())
+            fifos[c].pop_front();
+        else
+            heaps[c].pop();
+        --count;
+    }
+
+    inline size_t size() const { return count; }
+    inline bool empty() const { return count == 0; }
+};
+
+typedef LockedQueue<ClassStorage> PriorityQueue;
+
+/**
+ * Futex wrapper
+ *
+ * Waiters are counted, so wakers do not make syscall if nobody sleeps
+ */
+class Futex
+{
+private:
+    uint32_t event;         // changed on every wake
+    uint32_t waiters;       // amount of sleeping threads
+public:
+    Futex() : event(0), waiters(0) { }
+
+    // Sleeps until Wake if ready() is still false
+    // Returns result of ready()
+    template<typename T>
+    bool Wait(T& ready)
+    {
+        uint32_t seen = __atomic_load_n(&event, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+        bool result = ready();
+        if (!result)
+            syscall(SYS_futex, &event, FUTEX_WAIT_PRIVATE, seen,
+                NULL, NULL, 0);
+        __atomic_sub_fetch(&waiters, 1, __ATOMIC_SEQ_CST);
+        return result;
+    }
+
+    // Amount of threads in Wait
+    inline unsigned Waiters() const
+    {
+        return __atomic_load_n(&waiters, __ATOMIC_RELAXED);
+    }
+
+    // Wakes sleeping threads
+    inline void Wake(int count = 1)
+    {
+        if (__atomic_load_n(&waiters, __ATOMIC_SEQ_CST) == 0)
+            return;
+        __atomic_add_fetch(&event, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &event, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+    }
+};
+
+/**
+ * Asynchronous logger with per-thread rings
+ *
+ * Every thread formats records into its own lock-free SPSC ring,
+ * background thread drains all rings in batches and writes them
+ * with one syscall. Records are dropped if ring is full, thread
+ * never waits for output. Disabled level costs one comparison.
+ */
+class Logger
+{
+public:
+    enum Level { OFF, INFO, DEBUG };
+
+    /**
+     * Ring of preformatted records of one thread
+     */
+    class Channel : public CacheAligned
+    {
+    private:
+        friend class Logger;
+        struct Record
+        {
+            uint16_t length;
+            char text[LOG_RECORD - sizeof(uint16_t)];
+        };
+        size_t head __attribute__((aligned(CACHE_LINE)));   // drainer
+        size_t tail __attribute__((aligned(CACHE_LINE)));   // owner
+        unsigned long dropped;
+        Record records[LOG_RING];
+
+        Channel() : head(0), tail(0), dropped(0) { }
+    };
+private:
+    Level level;
+    int fd;
+    std::vector<Channel*> channels;
+    size_t opened;
+    int stopped;
+    Futex pending;
+    pthread_t thread;
+
+    // Binder for Futex::Wait
+    struct PendingF
+    {
+        Logger* log;
+        inline bool operator()() { return log->Pending(); }
+    };
+
+    inline Channel* Get(size_t i) const
+    {
+        return __atomic_load_n(&channels[i], __ATOMIC_ACQUIRE);
+    }
+
+    // Checks whether any record is waiting or logger is stopped
+    bool Pending() const
+    {
+        if (__atomic_load_n(&stopped, __ATOMIC_ACQUIRE))
+            return true;
+        for (size_t i = 0; i < channels.size(); ++i)
+        {
+            Channel* channel = Get(i);
+            if (channel && channel->head
+                != __atomic_load_n(&channel->tail, __ATOMIC_ACQUIRE))
+                return true;
+        }
+        return false;
+    }
+
+    static void* Drain(void* self)
+    {
+        Logger* log = reinterpret_cast<Logger*>(self);
+        std::string lines;
+        while (true)
+        {
+            bool stopped = __atomic_load_n(&log->stopped, __ATOMIC_ACQUIRE);
+            for (size_t i = 0; i < log->channels.size(); ++i)
+            {
+                Channel* channel = log->Get(i);
+                if (!channel)
+                    continue;
+                size_t head = channel->head;
+                size_t tail = __atomic_load_n(&channel->tail, __ATOMIC_ACQUIRE);
+                for (; head != tail; ++head)
+                {
+                    const Channel::Record& record
+                        = channel->records[head & (LOG_RING - 1)];
+                    lines.append(record.text, record.length);
+                }
+                __atomic_store_n(&channel->head, head, __ATOMIC_RELEASE);
+            }
+
+            for (size_t done = 0; done < lines.size(); )
+            {
+                ssize_t result = write(log->fd, lines.data() + done,
+                    lines.size() - done);
+                if (result <= 0)
+                    break;
+                done += result;
+            }
+
+            // Everything written before Stop is drained already
+            if (lines.empty() && stopped)
+                return NULL;
+
+            if (lines.empty())
+            {
+                PendingF f = { log };
+                log->pending.Wait(f);
+            }
+            lines.clear();
+        }
+    }
+public:
+    Logger(Level level, int fd, size_t threads)
+        : level(level)
+        , fd(fd)
+        , channels(threads, static_cast<Channel*>(NULL))
+        , opened(0)
+        , stopped(0)
+    {
+        if (level != OFF)
+            pthread_create(&thread, NULL, Drain, this);
+    }
+
+    // Parses level name, returns false if it is unknown
+    static bool ParseLevel(const char* name, Level& result)
+    {
+        static const char* const names[] = { "off", "info", "debug" };
+        for (int i = OFF; i <= DEBUG; ++i)
+            if (!std::strcmp(name, names[i]))
+            {
+                result = static_cast<Level>(i);
+                return true;
+            }
+        return false;
+    }
+
+    inline bool Enabled(Level at) const { return at <= level; }
+
+    // Creates ring for calling thread, NULL if logging is off
+    Channel* Open()
+    {
+        if (level == OFF)
+            return NULL;
+        size_t i = __sync_fetch_and_add(&opened, 1);
+        if (i >= channels.size())
+            return NULL;
+        __atomic_store_n(&channels[i], new Channel(), __ATOMIC_RELEASE);
+        return channels[i];
+    }
+
+    // Formats record into ring of thread, drops it if ring is full
+    void Write(Channel* channel, const char* format, ...)
+        __attribute__((format(printf, 3, 4)))
+    {
+        if (!channel)
+            return;
+        size_t tail = channel->tail;
+        if (tail - __atomic_load_n(&channel->head, __ATOMIC_ACQUIRE)
+            == LOG_RING)
+        {
+            ++channel->dropped;
+            return;
+        }
+
+        Channel::Record& record = channel->records[tail & (LOG_RING - 1)];
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(record.text, sizeof(record.text), format, args);
+        va_end(args);
+        if (length < 0)
+            return;
+        record.length = std::min((size_t)length, sizeof(record.text) - 1);
+
+        __atomic_store_n(&channel->tail, tail + 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        pending.Wake();
+    }
+
+    // Writes everything and stops background thread
+    void Stop()
+    {
+        if (level == OFF)
+            return;
+        __atomic_store_n(&stopped, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        pending.Wake();
+        pthread_join(thread, NULL);
+    }
+
+    // Amount of records lost on full rings
+    unsigned long Dropped() const
+    {
+        unsigned long result = 0;
+        for (size_t i = 0; i < channels.size(); ++i)
+            if (Get(i))
+                result += Get(i)->dropped;
+        return result;
+    }
+};
+
+class Telemetry;
+
+/**
+ * Run options
+ */
+struct Options
+{
+    Distribution work;  // time for preparing document
+    Distribution print; // time for printing document
+    size_t batch;       // documents moved through queue at once
+    uint64_t seed;      // seed of service time generators
+    int64_t start;      // office opening time
+    Logger* log;        // output of events
+    Telemetry* telemetry;   // latency recording, may be NULL
+    const char* json;       // file for telemetry in JSON, may be NULL
+    const Placement* placement;     // CPUs of threads
+    Catalog* catalog;       // classes of documents, may be NULL
+
+    Options()
+        : work(wTime)
+        , print(pTime)
+        , batch(1)
+        , seed(1)
+        , start(0)
+        , log(NULL)
+        , telemetry(NULL)
+        , json(NULL)
+        , placement(NULL)
+        , catalog(NULL)
+    { }
+};
+
+/**
+ * Lock-free bounded document queue
+ *
+ * D. Vyukov's MPMC ring: every cell has sequence number telling whether
+ * it is ready for producer of lap or for consumer of lap. Head and tail
+ * are on separate cache lines. Threads spin for a while when queue is
+ * empty or full, then sleep on futex; only one sleeper is woken
+ * by every push or pop.
+ */
+class RingQueue : public Queue, public CacheAligned
+{
+private:
+    struct Cell
+    {
+        size_t seq;
+        int data;
+    };
+
+    Cell* cells;
+    size_t qSize;
+    size_t tail __attribute__((aligned(CACHE_LINE)));   // push position
+    size_t head __attribute__((aligned(CACHE_LINE)));   // pop position
+    Futex doc_exist __attribute__((aligned(CACHE_LINE)));
+    Futex free_space_exist __attribute__((aligned(CACHE_LINE)));
+
+    // Binders for Futex::Wait
+    struct TryPushF
+    {
+        RingQueue* q;
+        int what;
+        inline bool operator()() { return q->TryPush(what); }
+    };
+    struct TryPopF
+    {
+        RingQueue* q;
+        int result;
+        inline bool operator()() { return q->TryPop(result); }
+    };
+    struct TryPushBatchF
+    {
+        RingQueue* q;
+        const int* what;
+        size_t count;
+        size_t done;
+        inline bool operator()()
+        {
+            return (done = q->TryPushBatch(what, count)) > 0;
+        }
+    };
+    struct TryPopBatchF
+    {
+        RingQueue* q;
+        int* result;
+        size_t max;
+        size_t done;
+        inline bool operator()()
+        {
+            return (done = q->TryPopBatch(result, max)) > 0;
+        }
+    };
+
+    // Spins, then sleeps until ready() is true
+    template<typename T>
+    void Wait(Futex& futex, T& ready)
+    {
+        bool done = ready();
+        for (size_t i = 0; !done; ++i)
+        {
+            if (i < SPIN_COUNT)
+            {
+                done = ready();
+                continue;
+            }
+            done = futex.Wait(ready);
+            if (!done)
+                Count(sleeps);
+        }
+    }
+public:
+    RingQueue(size_t qSize)
+        : cells(new Cell[qSize])
+        , qSize(qSize)
+        , tail(0)
+        , head(0)
+    {
+        for (size_t i = 0; i < qSize; ++i)
+            cells[i].seq = i;
+    }
+
+    bool TryPush(int what)
+    {
+        size_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        while (true)
+        {
+            Cell& cell = cells[pos % qSize];
+            size_t seq = __atomic_load_n(&cell.seq, __ATOMIC_ACQUIRE);
+            if (seq == pos)
+            {
+                if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                    cell.data = what;
+                    __atomic_store_n(&cell.seq, pos + 1, __ATOMIC_RELEASE);
+                    return true;
+                }
+                Count(contended);
+            }
+            else if (seq < pos) // cell is not consumed yet, queue is full
+            {
+                return false;
+            }
+            else {
+                pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    // Claims consecutive free cells with one CAS
+    // Returns amount of pushed documents, 0 if queue is full
+    size_t TryPushBatch(const int* what, size_t count)
+    {
+        size_t pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        while (true)
+        {
+            size_t n = 0;
+            while (n < count && n < qSize
+                && __atomic_load_n(&cells[(pos + n) % qSize].seq,
+                       __ATOMIC_ACQUIRE) == pos + n)
+            {
+                ++n;
+            }
+
+            if (n == 0)
+            {
+                size_t seq = __atomic_load_n(&cells[pos % qSize].seq,
+                    __ATOMIC_ACQUIRE);
+                if (seq < pos)
+                    return 0;
+                pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            if (__atomic_compare_exchange_n(&tail, &pos, pos + n, false,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                for (size_t i = 0; i < n; ++i)
+                {
+                    Cell& cell = cells[(pos + i) % qSize];
+                    cell.data = what[i];
+                    __atomic_store_n(&cell.seq, pos + i + 1,
+                        __ATOMIC_RELEASE);
+                }
+                return n;
+            }
+            Count(contended);
+        }
+    }
+
+    // Claims consecutive filled cells with one CAS
+    // Returns amount of popped documents, 0 if queue is empty
+    size_t TryPopBatch(int* result, size_t max)
+    {
+        size_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        while (true)
+        {
+            size_t n = 0;
+            while (n < max && n < qSize
+                && __atomic_load_n(&cells[(pos + n) % qSize].seq,
+                       __ATOMIC_ACQUIRE) == pos + n + 1)
+            {
+                ++n;
+            }
+
+            if (n == 0)
+            {
+                size_t seq = __atomic_load_n(&cells[pos % qSize].seq,
+                    __ATOMIC_ACQUIRE);
+                if (seq < pos + 1)
+                    return 0;
+                pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+                continue;
+            }
+
+            if (__atomic_compare_exchange_n(&head, &pos, pos + n, false,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                for (size_t i = 0; i < n; ++i)
+                {
+                    Cell& cell = cells[(pos + i) % qSize];
+                    result[i] = cell.data;
+                    __atomic_store_n(&cell.seq, pos + i + qSize,
+                        __ATOMIC_RELEASE);
+                }
+                return n;
+            }
+            Count(contended);
+        }
+    }
+
+    bool TryPop(int& result)
+    {
+        size_t pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        while (true)
+        {
+            Cell& cell = cells[pos % qSize];
+            size_t seq = __atomic_load_n(&cell.seq, __ATOMIC_ACQUIRE);
+            if (seq == pos + 1)
+            {
+                if (__atomic_compare_exchange_n(&head, &pos, pos + 1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                {
+                    result = cell.data;
+                    __atomic_store_n(&cell.seq, pos + qSize,
+                        __ATOMIC_RELEASE);
+                    return true;
+                }
+                Count(contended);
+            }
+            else if (seq < pos + 1) // cell is not filled yet, queue is empty
+            {
+                return false;
+            }
+            else {
+                pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    // Spins, then sleeps while queue is full
+    void Push(int what)
+    {
+        TryPushF f = { this, what };
+        Wait(free_space_exist, f);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        doc_exist.Wake();
+    }
+
+    // Spins, then sleeps while queue is full
+    // Wakes as many consumers as documents were pushed at once
+    void PushBatch(const int* what, size_t count)
+    {
+        while (count > 0)
+        {
+            TryPushBatchF f = { this, what, count, 0 };
+            Wait(free_space_exist, f);
+            what += f.done;
+            count -= f.done;
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            doc_exist.Wake(f.done);
+        }
+    }
+
+    // Spins, then sleeps while queue is empty
+    int Pop()
+    {
+        TryPopF f = { this, 0 };
+        Wait(doc_exist, f);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        free_space_exist.Wake();
+        return f.result;
+    }
+
+    // Spins, then sleeps while queue is empty
+    size_t PopBatch(int* result, size_t max)
+    {
+        TryPopBatchF f = { this, result, max, 0 };
+        Wait(doc_exist, f);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        free_space_exist.Wake(f.done);
+        return f.done;
+    }
+
+    Gauge Sample()
+    {
+        size_t pushed = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        size_t popped = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        Gauge result = { pushed > popped ? pushed - popped : 0,
+            free_space_exist.Waiters(), doc_exist.Waiters() };
+        return result;
+    }
+
+    ~RingQueue() { delete[] cells; }
+};
+
+/**
+ * Chase-Lev work-stealing deque of fixed capacity
+ *
+ * Owner pushes and pops at bottom, thieves steal from top
+ */
+class WorkDeque : public CacheAligned
+{
+private:
+    long top __attribute__((aligned(CACHE_LINE)));
+    long bottom __attribute__((aligned(CACHE_LINE)));
+    int* buffer;
+    long mask;
+public:
+    WorkDeque(size_t capacity) : top(0), bottom(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size *= 2;
+        buffer = new int[size];
+        mask = size - 1;
+    }
+
+    inline size_t Capacity() const { return mask + 1; }
+
+    // Owner push, returns false if deque is full
+    bool Push(int what)
+    {
+        long b = __atomic_load_n(&bottom, __ATOMIC_RELAXED);
+        long t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+        if (b - t > mask)
+            return false;
+        __atomic_store_n(&buffer[b & mask], what, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    // Owner pop, returns false if deque is empty
+    bool Pop(int& result)
+    {
+        long b = __atomic_load_n(&bottom, __ATOMIC_RELAXED) - 1;
+        __atomic_store_n(&bottom, b, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long t = __atomic_load_n(&top, __ATOMIC_RELAXED);
+
+        bool found = t <= b;
+        if (found)
+        {
+            result = __atomic_load_n(&buffer[b & mask], __ATOMIC_RELAXED);
+
+            // The last element may be taken by thief
+            if (t == b)
+            {
+                found = __atomic_compare_exchange_n(&top, &t, t + 1, false,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+                __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+            }
+        }
+        else {
+            __atomic_store_n(&bottom, b + 1, __ATOMIC_RELAXED);
+        }
+        return found;
+    }
+
+    // Thief pop, returns false if deque is empty or race is lost
+    bool Steal(int& result)
+    {
+        long t = __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long b = __atomic_load_n(&bottom, __ATOMIC_ACQUIRE);
+        if (t >= b)
+            return false;
+
+        result = __atomic_load_n(&buffer[t & mask], __ATOMIC_RELAXED);
+        return __atomic_compare_exchange_n(&top, &t, t + 1, false,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    }
+
+    // Approximate amount of documents
+    inline size_t Size() const
+    {
+        long b = __atomic_load_n(&bottom, __ATOMIC_RELAXED);
+        long t = __atomic_load_n(&top, __ATOMIC_RELAXED);
+        return b > t ? b - t : 0;
+    }
+
+    ~WorkDeque() { delete[] buffer; }
+};
+
+/**
+ * Work-stealing document queues
+ *
+ * Workers put documents to inboxes of printers by round-robin or by
+ * affinity (worker rank modulo amount of printers). Printer moves its
+ * inbox to its own deque, and when both are empty it steals from peers.
+ * Workers and printers access it through ports, which are Queue.
+ */
+class StealingQueue
+{
+public:
+    enum Distribution { ROUND_ROBIN, AFFINITY };
+private:
+    /**
+     * Printer's part
+     */
+    struct Shard : public CacheAligned
+    {
+        RingQueue* inbox;
+        WorkDeque* deque;
+        std::vector<int> refill;        // buffer for inbox batch
+        int64_t idle;                   // time spent waiting for documents
+        unsigned long documents;        // printed documents
+        unsigned long steals;           // documents taken from peers
+
+        Shard(size_t qSize)
+            : inbox(new RingQueue(qSize))
+            , deque(new WorkDeque(qSize))
+            , refill(deque->Capacity())
+            , idle(0)
+            , documents(0)
+            , steals(0)
+        { }
+    };
+
+    /**
+     * Queue interface for one thread
+     */
+    class Port : public Queue
+    {
+    private:
+        StealingQueue* hub;
+        size_t rank;
+    public:
+        Port(StealingQueue* hub, size_t rank) : hub(hub), rank(rank) { }
+
+        void Push(int what) { hub->Push(what); }
+        void PushBatch(const int* what, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+                hub->Push(what[i]);
+        }
+        int Pop()
+        {
+            int result;
+            hub->PopBatch(rank, &result, 1);
+            return result;
+        }
+        size_t PopBatch(int* result, size_t max)
+        {
+            return hub->PopBatch(rank, result, max);
+        }
+        Gauge Sample() { return hub->Sample(); }
+        void Report(std::ostream& out) const { hub->Report(out); }
+    };
+
+    std::vector<Shard*> shards;
+    std::vector<Port*> ports;
+    std::vector<unsigned> next;         // next printer of every worker
+    size_t K;                           // documents of every worker
+    Distribution distribution;
+    Futex doc_exist;
+    Futex free_space_exist;
+    int64_t start;
+
+    // Binders for Futex::Wait
+    struct TryPutF
+    {
+        StealingQueue* hub;
+        int what;
+        inline bool operator()() { return hub->TryPut(what); }
+    };
+    struct TryTakeF
+    {
+        StealingQueue* hub;
+        size_t rank;
+        int result;
+        inline bool operator()() { return hub->TryTake(rank, result); }
+    };
+
+    // Puts document to inbox of selected printer or of any other one
+    bool TryPut(int what)
+    {
+        size_t M = shards.size();
+        size_t worker = what / K;
+        size_t first = distribution == AFFINITY
+            ? worker % M
+            : next[worker]++ % M;
+        for (size_t i = 0; i < M; ++i)
+            if (shards[(first + i) % M]->inbox->TryPush(what))
+                return true;
+        return false;
+    }
+
+    // Takes document from own deque, own inbox, then from peers
+    bool TryTake(size_t rank, int& result)
+    {
+        Shard* own = shards[rank];
+        if (own->deque->Pop(result))
+            return true;
+
+        size_t n = own->inbox->TryPopBatch(&own->refill[0],
+            own->refill.size());
+        if (n > 0)
+        {
+            result = own->refill[0];
+            for (size_t i = 1; i < n; ++i)
+                own->deque->Push(own->refill[i]);
+
+            // Sleeping peers steal the rest instead of waiting for pushes
+            if (n > 1)
+            {
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                doc_exist.Wake(std::min(n - 1, shards.size() - 1));
+            }
+            return true;
+        }
+
+        size_t M = shards.size();
+        for (size_t i = 1; i < M; ++i)
+        {
+            Shard* peer = shards[(rank + i) % M];
+            if (peer->deque->Steal(result) || peer->inbox->TryPop(result))
+            {
+                ++own->steals;
+                return true;
+            }
+        }
+        return false;
+    }
+public:
+    StealingQueue(size_t N, size_t M, size_t K, size_t qSize,
+        Distribution distribution)
+        : shards(M)
+        , ports(std::max(N, M))
+        , next(N, 0)
+        , K(K)
+        , distribution(distribution)
+        , start(Now())
+    {
+        for (size_t j = 0; j < M; ++j)
+            shards[j] = new Shard(qSize);
+        for (size_t i = 0; i < ports.size(); ++i)
+            ports[i] = new Port(this, i);
+        for (size_t i = 0; i < N; ++i)
+            next[i] = i;
+    }
+
+    // Queue interface for worker or printer of rank
+    inline Queue* GetPort(size_t rank) { return ports[rank]; }
+
+    // Spins, then sleeps while all inboxes are full
+    void Push(int what)
+    {
+        TryPutF f = { this, what };
+        bool done = f();
+        for (size_t i = 0; !done; ++i)
+            done = i < SPIN_COUNT ? f() : free_space_exist.Wait(f);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        doc_exist.Wake();
+    }
+
+    // Spins, then sleeps while there is nothing to take or steal,
+    // then takes up to max documents without waiting
+    // Returns amount of taken documents
+    size_t PopBatch(size_t rank, int* result, size_t max)
+    {
+        int64_t begin = Now();
+        TryTakeF f = { this, rank, 0 };
+        bool done = f();
+        for (size_t i = 0; !done; ++i)
+            done = i < SPIN_COUNT ? f() : doc_exist.Wait(f);
+        Shard* own = shards[rank];
+        own->idle += Now() - begin;
+
+        result[0] = f.result;
+        size_t n = 1;
+        while (n < max && TryTake(rank, result[n]))
+            ++n;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        free_space_exist.Wake(n);
+
+        own->documents += n;
+        return n;
+    }
+
+    Queue::Gauge Sample()
+    {
+        Queue::Gauge result = { 0, free_space_exist.Waiters(),
+            doc_exist.Waiters() };
+        for (size_t j = 0; j < shards.size(); ++j)
+            result.depth += shards[j]->inbox->Sample().depth
+                + shards[j]->deque->Size();
+        return result;
+    }
+
+    // Print of per-printer utilization
+    void Report(std::ostream& out) const
+    {
+        int64_t elapsed = Now() - start + 1;
+        for (size_t j = 0; j < shards.size(); ++j)
+        {
+            const Shard* shard = shards[j];
+            out << "[Printer " << std::setw(3) << j << ": "
+                << shard->documents << " documents, "
+                << shard->steals << " stolen, "
+                << std::min((int64_t)100, 100 - shard->idle * 100 / elapsed)
+                << "% busy]" << std::endl;
+        }
+    }
+};
+
+/**
+ * Document queue with shard per NUMA node
+ *
+ * Worker pushes to shard of its node only. Printer pops from shard of
+ * its node and steals from other nodes only when own shard is dry.
+ * Shard memory is touched from its node first, so kernel allocates it
+ * there. Threads access it through ports of nodes.
+ */
+class NodeQueue
+{
+private:
+    /**
+     * Part of node
+     */
+    struct Shard : public CacheAligned
+    {
+        RingQueue* ring;
+        Futex free_space_exist;     // producers of node wait for space
+        unsigned long pushed;       // documents from workers of node
+        unsigned long local;        // popped by printers of node
+        unsigned long stolen;       // popped by printers of other nodes
+
+        Shard(size_t qSize)
+            : ring(new RingQueue(qSize))
+            , pushed(0)
+            , local(0)
+            , stolen(0)
+        { }
+    };
+
+    /**
+     * Queue interface for threads of node, port of threads which are
+     * not pinned finds their node on every call
+     */
+    class Port : public Queue
+    {
+    private:
+        NodeQueue* hub;
+        size_t node;        // amount of nodes for floating port
+
+        inline size_t Here() const
+        {
+            return node < hub->shards.size() ? node
+                : hub->placement->Current();
+        }
+    public:
+        Port(NodeQueue* hub, size_t node) : hub(hub), node(node) { }
+
+        void Push(int what) { hub->Push(Here(), what); }
+        void PushBatch(const int* what, size_t count)
+        {
+            for (size_t i = 0; i < count; ++i)
+                hub->Push(Here(), what[i]);
+        }
+        int Pop()
+        {
+            int result;
+            hub->PopBatch(Here(), &result, 1);
+            return result;
+        }
+        size_t PopBatch(int* result, size_t max)
+        {
+            return hub->PopBatch(Here(), result, max);
+        }
+        Gauge Sample() { return hub->Sample(); }
+        void Report(std::ostream& out) const { hub->Report(out); }
+    };
+
+    std::vector<Shard*> shards;
+    std::vector<Port*> ports;       // port of every node and floating one
+    const Placement* placement;
+    Futex doc_exist;
+
+    // Binders for Futex::Wait
+    struct TryPutF
+    {
+        Shard* shard;
+        int what;
+        inline bool operator()() { return shard->ring->TryPush(what); }
+    };
+    struct TryTakeF
+    {
+        NodeQueue* hub;
+        size_t node;
+        int result;
+        inline bool operator()() { return hub->TryTake(node, result); }
+    };
+
+    // Takes document from own shard, then from other nodes,
+    // one producer of the shard is woken for the freed slot
+    bool TryTake(size_t node, int& result)
+    {
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            Shard* shard = shards[(node + i) % shards.size()];
+            if (shard->ring->TryPop(result))
+            {
+                __sync_fetch_and_add(i == 0 ? &shard->local
+                    : &shard->stolen, 1);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                shard->free_space_exist.Wake();
+                return true;
+            }
+        }
+        return false;
+    }
+public:
+    NodeQueue(size_t qSize, const Placement& placement)
+        : shards(placement.Nodes())
+        , ports(placement.Nodes() + 1)
+        , placement(&placement)
+    {
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            cpu_set_t saved = placement.Enter(i);
+            shards[i] = new Shard(qSize);
+            placement.Leave(saved);
+            ports[i] = new Port(this, i);
+        }
+        ports[shards.size()] = new Port(this, shards.size());
+    }
+
+    // Queue interface for threads of node
+    inline Queue* GetPort(size_t node) { return ports[node]; }
+
+    // Queue interface for thread of given number, the one which is
+    // not pinned uses node of CPU it is running on at every call
+    inline Queue* GetPort(size_t thread, size_t rank)
+    {
+        return placement->GetPolicy() == Placement::NONE
+            ? ports[shards.size()]
+            : ports[placement->Node(thread, rank)];
+    }
+
+    // Spins, then sleeps while shard of node is full
+    void Push(size_t node, int what)
+    {
+        TryPutF f = { shards[node], what };
+        bool done = f();
+        for (size_t i = 0; !done; ++i)
+            done = i < SPIN_COUNT ? f()
+                : shards[node]->free_space_exist.Wait(f);
+        __sync_fetch_and_add(&shards[node]->pushed, 1);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        doc_exist.Wake();
+    }
+
+    // Spins, then sleeps while all shards are empty,
+    // then takes up to max documents without waiting
+    // Returns amount of taken documents
+    size_t PopBatch(size_t node, int* result, size_t max)
+    {
+        TryTakeF f = { this, node, 0 };
+        bool done = f();
+        for (size_t i = 0; !done; ++i)
+            done = i < SPIN_COUNT ? f() : doc_exist.Wait(f);
+
+        result[0] = f.result;
+        size_t n = 1;
+        while (n < max && TryTake(node, result[n]))
+            ++n;
+        return n;
+    }
+
+    Queue::Gauge Sample()
+    {
+        Queue::Gauge result = { 0, 0, doc_exist.Waiters() };
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            result.depth += shards[i]->ring->Sample().depth;
+            result.producers += shards[i]->free_space_exist.Waiters();
+        }
+        return result;
+    }
+
+    // Print of traffic of every node
+    void Report(std::ostream& out) const
+    {
+        for (size_t i = 0; i < shards.size(); ++i)
+            out << "[Node " << i << ": " << shards[i]->pushed
+                << " documents pushed, " << shards[i]->local
+                << " printed locally, " << shards[i]->stolen
+                << " stolen]" << std::endl;
+    }
+};
+
+/**
+ * Lock-free histogram with HDR-style buckets
+ *
+ * Every power of two range is split into SUB_COUNT linear sub-buckets,
+ * so relative error is below 1/SUB_COUNT on the whole range of values
+ */
+class Histogram
+{
+private:
+    enum
+    {
+        SUB_BITS = 5,
+        SUB_COUNT = 1 << SUB_BITS,
+        BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT
+    };
+
+    uint64_t counts[BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+
+    static size_t Index(uint64_t value)
+    {
+        if (value < SUB_COUNT)
+            return value;
+        size_t shift = 63 - __builtin_clzl(value) - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + (value >> shift) - SUB_COUNT;
+    }
+
+    // Middle of bucket range
+    static uint64_t Value(size_t index)
+    {
+        if (index < SUB_COUNT)
+            return index;
+        size_t shift = index / SUB_COUNT - 1;
+        uint64_t low = (uint64_t)(index % SUB_COUNT + SUB_COUNT) << shift;
+        return low + ((uint64_t)1 << shift) / 2;
+    }
+public:
+    Histogram() : count(0), sum(0), max(0)
+    {
+        std::memset(counts, 0, sizeof(counts));
+    }
+
+    void Record(uint64_t value)
+    {
+        __atomic_fetch_add(&counts[Index(value)], 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sum, value, __ATOMIC_RELAXED);
+        uint64_t seen = __atomic_load_n(&max, __ATOMIC_RELAXED);
+        while (value > seen && !__atomic_compare_exchange_n(&max, &seen,
+            value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+
+    inline uint64_t Count() const { return count; }
+    inline uint64_t Max() const { return max; }
+    inline double Mean() const { return count ? (double)sum / count : 0; }
+
+    // Value below which part of records lies
+    uint64_t Percentile(double part) const
+    {
+        uint64_t rank = (uint64_t)std::ceil(part * count);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i)
+        {
+            seen += counts[i];
+            if (seen >= rank && seen > 0)
+                return std::min(Value(i), max);
+        }
+        return max;
+    }
+};
+
+/**
+ * Latency and queue depth telemetry
+ *
+ * Documents are stamped when written and when pushed, printers record
+ * wait (push to pop, including time blocked on full queue), service
+ * and end-to-end time. Background thread samples queue gauge.
+ */
+class Telemetry
+{
+private:
+    struct Sample
+    {
+        int64_t time;
+        Queue::Gauge gauge;
+    };
+
+    Histogram wait;
+    Histogram service;
+    Histogram latency;
+    const Catalog* catalog;             // classes of documents, may be NULL
+    std::vector<Histogram*> classWait;
+    std::vector<Histogram*> classLatency;
+    std::vector<unsigned long> missed;  // deadlines missed by class
+    std::vector<int64_t> written;       // ns, by document
+    std::vector<int64_t> enqueued;      // ns, by document
+    Queue* q;
+    int64_t interval;                   // us
+    int64_t start;
+    std::vector<Sample> samples;
+    int stopped;
+    pthread_t thread;
+
+    static void* Sampler(void* self)
+    {
+        Telemetry* telemetry = reinterpret_cast<Telemetry*>(self);
+        while (!__atomic_load_n(&telemetry->stopped, __ATOMIC_ACQUIRE))
+        {
+            Sample sample = { Now() - telemetry->start,
+                telemetry->q->Sample() };
+            telemetry->samples.push_back(sample);
+            Pause(telemetry->interval / 1e6);
+        }
+        return NULL;
+    }
+
+    static void Print(std::ostream& out, const char* name,
+        const Histogram& histogram)
+    {
+        out << "[" << name << ": " << histogram.Count() << " documents, mean "
+            << histogram.Mean() / 1000 << " us, p50 "
+            << histogram.Percentile(0.5) / 1000.0 << ", p99 "
+            << histogram.Percentile(0.99) / 1000.0 << ", p99.9 "
+            << histogram.Percentile(0.999) / 1000.0 << ", max "
+            << histogram.Max() / 1000.0 << " us]" << std::endl;
+    }
+
+    static void PrintJson(std::ostream& out, const char* name,
+        const Histogram& histogram)
+    {
+        out << "    \"" << name << "\": {\"count\": " << histogram.Count()
+            << ", \"mean\": " << histogram.Mean() / 1000
+            << ", \"p50\": " << histogram.Percentile(0.5) / 1000.0
+            << ", \"p99\": " << histogram.Percentile(0.99) / 1000.0
+            << ", \"p999\": " << histogram.Percentile(0.999) / 1000.0
+            << ", \"max\": " << histogram.Max() / 1000.0 << "}";
+    }
+public:
+    Telemetry(size_t documents, Queue* q, int64_t interval,
+        const Catalog* catalog)
+        : catalog(catalog)
+        , written(documents)
+        , enqueued(documents)
+        , q(q)
+        , interval(std::max((int64_t)1, interval))
+        , start(Now())
+        , stopped(0)
+    {
+        for (size_t c = 0; catalog && c < catalog->Classes(); ++c)
+        {
+            classWait.push_back(new Histogram());
+            classLatency.push_back(new Histogram());
+        }
+        missed.resize(classWait.size(), 0);
+        pthread_create(&thread, NULL, Sampler, this);
+    }
+
+    inline void Written(int document) { written[document] = NowNs(); }
+
+    // Stamps documents given to queue at once
+    inline void Enqueued(const int* documents, size_t count)
+    {
+        int64_t now = NowNs();
+        for (size_t i = 0; i < count; ++i)
+            enqueued[documents[i]] = now;
+    }
+
+    // Records document taken from queue at time taken and printed
+    // from begin to end
+    inline void Printed(int document, int64_t taken, int64_t begin,
+        int64_t end)
+    {
+        wait.Record(std::max((int64_t)0, taken - enqueued[document]));
+        service.Record(end - begin);
+        latency.Record(end - written[document]);
+        if (!catalog)
+            return;
+
+        size_t c = catalog->Class(document);
+        classWait[c]->Record(std::max((int64_t)0, taken - enqueued[document]));
+        classLatency[c]->Record(end - written[document]);
+        int64_t deadline = catalog->Deadline(document);
+        if (deadline && end > deadline)
+            __sync_fetch_and_add(&missed[c], 1);
+    }
+
+    // Stops sampling, waits at most one interval
+    void Stop()
+    {
+        __atomic_store_n(&stopped, 1, __ATOMIC_RELEASE);
+        pthread_join(thread, NULL);
+    }
+
+    // Human-readable report, time series is thinned to some rows
+    void Report(std::ostream& out) const
+    {
+        Print(out, "Wait", wait);
+        Print(out, "Service", service);
+        Print(out, "Latency", latency);
+        for (size_t c = 0; c < classWait.size(); ++c)
+        {
+            std::ostringstream name;
+            name << "Class " << c << " wait";
+            Print(out, name.str().c_str(), *classWait[c]);
+            name.str("");
+            name << "Class " << c << " latency";
+            Print(out, name.str().c_str(), *classLatency[c]);
+            if (catalog->HasDeadline(c))
+                out << "[Class " << c << " deadlines: " << missed[c]
+                    << " of " << classLatency[c]->Count() << " missed]"
+                    << std::endl;
+        }
+
+        const size_t rows = 20;
+        size_t step = (samples.size() + rows - 1) / rows;
+        out << "|   time ms | depth | blocked producers | blocked consumers |"
+            << std::endl;
+        for (size_t i = 0; i < samples.size(); i += step)
+        {
+            const Sample& sample = samples[i];
+            out << "| " << std::setw(9) << sample.time / 1000
+                << " | " << std::setw(5) << sample.gauge.depth
+                << " | " << std::setw(17) << sample.gauge.producers
+                << " | " << std::setw(17) << sample.gauge.consumers
+                << " |" << std::endl;
+        }
+    }
+
+    // Full report in JSON, times are in microseconds
+    void ReportJson(std::ostream& out) const
+    {
+        out << "{" << std::endl << "  \"interval\": " << interval << ","
+            << std::endl << "  \"histograms\": {" << std::endl;
+        PrintJson(out, "wait", wait);
+        out << "," << std::endl;
+        PrintJson(out, "service", service);
+        out << "," << std::endl;
+        PrintJson(out, "latency", latency);
+        out << std::endl << "  }," << std::endl << "  \"classes\": [";
+        for (size_t c = 0; c < classWait.size(); ++c)
+        {
+            out << (c ? "," : "") << std::endl << "  {" << std::endl;
+            PrintJson(out, "wait", *classWait[c]);
+            out << "," << std::endl;
+            PrintJson(out, "latency", *classLatency[c]);
+            out << "," << std::endl << "    \"missed\": " << missed[c]
+                << std::endl << "  }";
+        }
+        out << std::endl << "  ]," << std::endl
+            << "  \"samples\": [";
+        for (size_t i = 0; i < samples.size(); ++i)
+        {
+            const Sample& sample = samples[i];
+            out << (i ? ",\n" : "\n") << "    {\"time\": " << sample.time
+                << ", \"depth\": " << sample.gauge.depth
+                << ", \"producers\": " << sample.gauge.producers
+                << ", \"consumers\": " << sample.gauge.consumers << "}";
+        }
+        out << std::endl << "  ]" << std::endl << "}" << std::endl;
+    }
+};
+
+/**
+ * Task type
+ */
+struct Task {
+    Table* table;
+    Queue* q;
+    int rank;
+    std::vector<Task*>& tasks;
+    const Options* options;
+    
+    Task(Table* table, Queue* q, int rank, std::vector<Task*>& tasks,
+        const Options* options)
+        : table(table)
+        , q(q)
+        , rank(rank)
+        , tasks(tasks)
+        , options(options)
+    { }
+};
+
+/**
+ * Prints results of closed office
+ */
+static void Close(Table* table, Queue* q, const Options* options)
+{
+    int64_t elapsed = Now() - options->start;
+    Logger* log = options->log;
+    log->Stop();
+    std::cout << "Office was closed." << std::endl;
+    if (log->Enabled(Logger::INFO))
+        table->Print();
+    if (log->Dropped())
+        std::cout << "[" << log->Dropped() << " log records dropped]"
+            << std::endl;
+    std::cout << "[" << table->GetN() * table->GetK() << " documents in "
+        << elapsed << " us, "
+        << (int64_t)(table->GetN() * table->GetK() * 1e6 / (elapsed + 1))
+        << " documents/s]" << std::endl;
+    if (options->placement)
+        std::cout << "[Placement: "
+            << Placement::Name(options->placement->GetPolicy()) << ", "
+            << options->placement->Nodes() << " nodes, "
+            << options->placement->Cpus() << " CPUs]" << std::endl;
+    q->Report(std::cout);
+    Telemetry* telemetry = options->telemetry;
+    if (telemetry)
+    {
+        telemetry->Stop();
+        telemetry->Report(std::cout);
+        if (options->json)
+        {
+            std::ofstream json(options->json);
+            telemetry->ReportJson(json);
+            if (!json)
+                std::cerr << "Error in writing " << options->json << std::endl;
+        }
+    }
+}
+
+/**
+ * Worker thread
+ * @param t pointer to task_t
+ */
+void* worker(void* t)
+{
+    Task* task   = reinterpret_cast<Task*>(t);
+    Table* table = task->table;
+    Queue* q     = task->q;
+    size_t rank  = task->rank;
+    size_t K     = table->GetK();
+    const Options* options = task->options;
+    Logger* log  = options->log;
+    Logger::Channel* channel = log->Open();
+    Random random(options->seed + rank);
+    Telemetry* telemetry = options->telemetry;
+    if (log->Enabled(Logger::INFO))
+        log->Write(channel, "Worker %3lu: came to office\n",
+            (unsigned long)rank);
+
+    // Documents are kept until batch is full
+    std::vector<int> ready;
+    ready.reserve(options->batch);
+
+    for (size_t sended = 0; sended < K; ++sended)
+    {
+        Pause(options->work.Sample(random));
+        if (log->Enabled(Logger::DEBUG))
+            log->Write(channel, "Worker %3lu: wrote %lu document\n",
+                (unsigned long)rank, (unsigned long)sended);
+
+        // Document is numbered through the office, its worker is id / K
+        int document = rank * K + sended;
+        if (options->catalog)
+            options->catalog->Assign(document, NowNs(), random);
+        if (telemetry)
+            telemetry->Written(document);
+        if (options->batch == 1)
+        {
+            if (telemetry)
+                telemetry->Enqueued(&document, 1);
+            TRACE_EVENT(queue_push, document);
+            q->Push(document);
+            continue;
+        }
+
+        ready.push_back(document);
+        if (ready.size() == options->batch || sended + 1 == K)
+        {
+            if (telemetry)
+                telemetry->Enqueued(&ready[0], ready.size());
+            TRACE_EVENT(queue_push_batch, ready.size());
+            q->PushBatch(&ready[0], ready.size());
+            ready.clear();
+        }
+    }
+
+    if (log->Enabled(Logger::INFO))
+        log->Write(channel, "Worker %3lu: went home\n", (unsigned long)rank);
+    pthread_exit(EXIT_SUCCESS);
+}
+
+/**
+ * Printer thread
+ * @param t pointer to task_t
  */
 void* printer(void* t)
 {
@@ -248,27 +2387,678 @@ void* printer(void* t)
     Queue* q     = task->q;
     size_t rank  = task->rank;
     size_t M     = table->GetM();
-    std::cout << "Printer "
-        << std::setw(3) << rank << ": turned on" << std::endl;
+    const Options* options = task->options;
+    Logger* log  = options->log;
+    Logger::Channel* channel = log->Open();
+    Random random(options->seed + table->GetN() + rank);
+    Telemetry* telemetry = options->telemetry;
+    size_t K     = table->GetK();
+    table->Localize(rank);
+    if (log->Enabled(Logger::INFO))
+        log->Write(channel, "Printer %3lu: turned on\n", (unsigned long)rank);
 
+    std::vector<int> documents(options->batch);
     while (table->Check())
     {
-        const int document = q->Pop();
-        sleep(pTime);
-        table->Add(rank, document);
+        size_t count = 1;
+        if (options->batch == 1)
+            documents[0] = q->Pop();
+        else
+            count = q->PopBatch(&documents[0], options->batch);
+        TRACE_EVENT(queue_pop, count);
+
+        int64_t taken = telemetry ? NowNs() : 0;
+        int64_t begin = taken;
+        for (size_t i = 0; i < count; ++i)
+        {
+            TRACE_BEGIN(print);
+            Pause(options->print.Sample(random));
+            TRACE_END(print);
+            if (telemetry)
+            {
+                int64_t end = NowNs();
+                telemetry->Printed(documents[i], taken, begin, end);
+                begin = end;
+            }
+            int worker = documents[i] / K;
+            int left = table->Add(rank, worker);
+            if (log->Enabled(Logger::DEBUG))
+                log->Write(channel, "Printer %lu: document from %d "
+                    "(%d left).\n", (unsigned long)rank, worker, left);
+        }
     }
-    std::cout << "Office was closed." << std::endl;
-    table->Print();
-    delete q;
+
+    // Other printers may see the last job done too
+    if (!table->Close())
+        pthread_exit(EXIT_SUCCESS);
+
+    Close(table, q, options);
     std::vector<Task*>& tasks = task->tasks;
 
     for (size_t i = 0; i < M; ++i)
         delete tasks[i];
 
-    delete table;
+    // Queue and table are not destroyed: other printers may still
+    // wait on them, and pthread_cond_destroy would wait for them too
     std::exit(EXIT_SUCCESS);
 }
 
+/**
+ * Stackless coroutine
+ *
+ * Coroutine keeps its state in members and returns from Resume at
+ * every suspension point. Before suspension it gives itself to queue
+ * or timer, and it must not touch its members after that, since other
+ * pool thread may resume it at once.
+ */
+class Coroutine
+{
+public:
+    // Runs till suspension point, returns false when finished
+    virtual bool Resume(Logger::Channel* channel) = 0;
+    virtual ~Coroutine() { }
+};
+
+/**
+ * Pool of threads running ready coroutines
+ */
+class Scheduler
+{
+private:
+    typedef std::pair<int64_t, Coroutine*> Timer;   // due time, us
+
+    Mutex mutex;
+    Cond wake;
+    std::deque<Coroutine*> ready;
+    std::priority_queue<Timer, std::vector<Timer>,
+        std::greater<Timer> > timers;
+    bool stopped;
+    Logger* log;
+    std::vector<pthread_t> threads;
+
+    // Moves expired timers to ready, returns time of the next one or -1
+    int64_t Expire()
+    {
+        int64_t now = Now();
+        while (!timers.empty() && timers.top().first <= now)
+        {
+            ready.push_back(timers.top().second);
+            timers.pop();
+        }
+        return timers.empty() ? -1 : timers.top().first - now;
+    }
+
+    static void* Run(void* self)
+    {
+        Scheduler* scheduler = reinterpret_cast<Scheduler*>(self);
+        Logger::Channel* channel = scheduler->log->Open();
+        Mutex& mutex = scheduler->mutex;
+        mutex.Lock();
+        while (!scheduler->stopped)
+        {
+            int64_t next = scheduler->Expire();
+            if (!scheduler->ready.empty())
+            {
+                Coroutine* coroutine = scheduler->ready.front();
+                scheduler->ready.pop_front();
+                mutex.Unlock();
+                if (!coroutine->Resume(channel))
+                    delete coroutine;
+                mutex.Lock();
+            }
+            else if (next >= 0)
+            {
+                timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                int64_t due = (int64_t)ts.tv_sec * 1000000
+                    + ts.tv_nsec / 1000 + next;
+                ts.tv_sec = due / 1000000;
+                ts.tv_nsec = due % 1000000 * 1000;
+                scheduler->wake.TimedWait(mutex, &ts);
+            }
+            else {
+                scheduler->wake.Wait(mutex);
+            }
+        }
+        mutex.Unlock();
+        return NULL;
+    }
+public:
+    Scheduler(Logger* log) : stopped(false), log(log) { }
+
+    // Starts pool, returns error code of pthread_create
+    int Start(size_t count)
+    {
+        threads.resize(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            int error = pthread_create(&threads[i], NULL, Run, this);
+            if (error != 0)
+            {
+                threads.resize(i);
+                return error;
+            }
+        }
+        return 0;
+    }
+
+    // Makes coroutine ready
+    void Ready(Coroutine* coroutine)
+    {
+        mutex.Lock();
+        ready.push_back(coroutine);
+        mutex.Unlock();
+        wake.Signal();
+    }
+
+    // Resumes coroutine after given time
+    void Sleep(Coroutine* coroutine, double seconds)
+    {
+        mutex.Lock();
+        bool earliest = timers.empty()
+            || Now() + (int64_t)(seconds * 1e6) < timers.top().first;
+        timers.push(Timer(Now() + (int64_t)(seconds * 1e6), coroutine));
+        mutex.Unlock();
+        if (earliest)
+            wake.Signal();
+    }
+
+    // Stops pool, suspended coroutines are left as is
+    void Stop()
+    {
+        mutex.Lock();
+        stopped = true;
+        mutex.Unlock();
+        wake.Broadcast();
+    }
+
+    void Join()
+    {
+        for (size_t i = 0; i < threads.size(); ++i)
+            pthread_join(threads[i], NULL);
+    }
+};
+
+/**
+ * Document queue for coroutines
+ *
+ * Instead of sleeping on condition, coroutine is put to wait list and
+ * is made ready by the opposite operation
+ */
+class CoQueue : public MutexQueue
+{
+private:
+    Scheduler* scheduler;
+    std::deque<Coroutine*> pushing;     // waiting for free space
+    std::deque<Coroutine*> popping;     // waiting for document
+
+    // Makes first waiting coroutine ready, called under lock
+    inline void WakeFirst(std::deque<Coroutine*>& waiting)
+    {
+        if (waiting.empty())
+            return;
+        scheduler->Ready(waiting.front());
+        waiting.pop_front();
+    }
+public:
+    CoQueue(size_t qSize, Scheduler* scheduler)
+        : MutexQueue(qSize)
+        , scheduler(scheduler)
+    { }
+
+    // Pushes document or suspends coroutine till free space exists
+    bool TryPush(Coroutine* coroutine, int what)
+    {
+        Lock();
+        bool done = this->size() < qSize;
+        if (done)
+        {
+            this->push(what);
+            WakeFirst(popping);
+        }
+        else {
+            Count(sleeps);
+            pushing.push_back(coroutine);
+        }
+        mutex.Unlock();
+        return done;
+    }
+
+    // Pops document or suspends coroutine till document exists
+    bool TryPop(Coroutine* coroutine, int& result)
+    {
+        Lock();
+        bool done = !this->empty();
+        if (done)
+        {
+            result = this->front();
+            this->pop();
+            WakeFirst(pushing);
+        }
+        else {
+            Count(sleeps);
+            popping.push_back(coroutine);
+        }
+        mutex.Unlock();
+        return done;
+    }
+
+    Gauge Sample()
+    {
+        mutex.Lock();
+        Gauge result = { this->size(), (unsigned)pushing.size(),
+            (unsigned)popping.size() };
+        mutex.Unlock();
+        return result;
+    }
+};
+
+/**
+ * Objects shared by coroutines of office
+ */
+struct CoOffice
+{
+    Scheduler* scheduler;
+    CoQueue* q;
+    Table* table;
+    const Options* options;
+};
+
+/**
+ * Worker as coroutine
+ */
+class CoWorker : public Coroutine
+{
+private:
+    enum State { START, WORK, WRITE, PUSH };
+
+    const CoOffice* office;
+    int rank;
+    State state;
+    unsigned sended;
+    int document;
+    Random random;
+public:
+    CoWorker(const CoOffice* office, int rank)
+        : office(office)
+        , rank(rank)
+        , state(START)
+        , sended(0)
+        , document(0)
+        , random(office->options->seed + rank)
+    { }
+
+    bool Resume(Logger::Channel* channel)
+    {
+        const Options* options = office->options;
+        Logger* log = options->log;
+        size_t K = office->table->GetK();
+        while (true)
+        {
+            switch (state)
+            {
+            case START:
+                if (log->Enabled(Logger::INFO))
+                    log->Write(channel, "Worker %3d: came to office\n", rank);
+                state = WORK;
+                break;
+            case WORK:
+                if (sended == K)
+                {
+                    if (log->Enabled(Logger::INFO))
+                        log->Write(channel, "Worker %3d: went home\n", rank);
+                    return false;
+                }
+                state = WRITE;
+                {
+                    double time = options->work.Sample(random);
+                    if (time > 0)
+                    {
+                        office->scheduler->Sleep(this, time);
+                        return true;
+                    }
+                }
+                break;
+            case WRITE:
+                if (log->Enabled(Logger::DEBUG))
+                    log->Write(channel, "Worker %3d: wrote %u document\n",
+                        rank, sended);
+                document = rank * K + sended;
+                if (options->catalog)
+                    options->catalog->Assign(document, NowNs(), random);
+                if (options->telemetry)
+                {
+                    options->telemetry->Written(document);
+                    options->telemetry->Enqueued(&document, 1);
+                }
+                state = PUSH;
+                break;
+            case PUSH:
+                if (!office->q->TryPush(this, document))
+                    return true;
+                TRACE_EVENT(queue_push, document);
+                ++sended;
+                state = WORK;
+                break;
+            }
+        }
+    }
+};
+
+/**
+ * Printer as coroutine
+ *
+ * Printer of the last document stops the scheduler, so does any
+ * printer of office without documents
+ */
+class CoPrinter : public Coroutine
+{
+private:
+    enum State { START, POP, PRINT };
+
+    const CoOffice* office;
+    int rank;
+    State state;
+    int document;
+    int64_t taken;
+    Random random;
+public:
+    CoPrinter(const CoOffice* office, int rank)
+        : office(office)
+        , rank(rank)
+        , state(START)
+        , document(0)
+        , taken(0)
+        , random(office->options->seed + office->table->GetN() + rank)
+    { }
+
+    bool Resume(Logger::Channel* channel)
+    {
+        const Options* options = office->options;
+        Logger* log = options->log;
+        Table* table = office->table;
+        while (true)
+        {
+            switch (state)
+            {
+            case START:
+                if (log->Enabled(Logger::INFO))
+                    log->Write(channel, "Printer %3d: turned on\n", rank);
+                // Office without documents is finished at once,
+                // otherwise printers would wait for them forever
+                if (!table->Check())
+                {
+                    office->scheduler->Stop();
+                    return false;
+                }
+                state = POP;
+                break;
+            case POP:
+                if (!office->q->TryPop(this, document))
+                    return true;
+                TRACE_EVENT(queue_pop, 1);
+                taken = options->telemetry ? NowNs() : 0;
+                state = PRINT;
+                {
+                    double time = options->print.Sample(random);
+                    if (time > 0)
+                    {
+                        office->scheduler->Sleep(this, time);
+                        return true;
+                    }
+                }
+                break;
+            case PRINT:
+                if (options->telemetry)
+                    options->telemetry->Printed(document, taken, taken,
+                        NowNs());
+                {
+                    int worker = document / table->GetK();
+                    int left = table->Add(rank, worker);
+                    if (log->Enabled(Logger::DEBUG))
+                        log->Write(channel, "Printer %d: document from %d "
+                            "(%d left).\n", rank, worker, left);
+                    if (left == 0)
+                    {
+                        office->scheduler->Stop();
+                        return false;
+                    }
+                }
+                state = POP;
+                break;
+            }
+        }
+    }
+};
+
+/**
+ * Discrete-event model of office
+ *
+ * Workers and printers are not threads but events in a priority queue
+ * ordered by virtual time, so millions of documents take seconds.
+ * Document written to full queue blocks its worker till some printer
+ * takes a document, as Push does.
+ */
+class Simulation
+{
+private:
+    enum EventType { WRITTEN, PRINTED };
+
+    struct Event
+    {
+        double time;
+        EventType type;
+        size_t id;      // rank of worker or printer
+
+        Event(double time, EventType type, size_t id)
+            : time(time), type(type), id(id)
+        { }
+        bool operator>(const Event& other) const
+        {
+            return time > other.time;
+        }
+    };
+
+    struct Document
+    {
+        size_t worker;
+        double written;     // time of leaving worker
+        double queued;      // time of entering queue
+    };
+
+    size_t N, M, K, qSize;
+    const Options* options;
+    Random random;
+    std::priority_queue<Event, std::vector<Event>,
+        std::greater<Event> > events;
+    std::deque<Document> queue;
+    std::deque<Document> blocked;       // written to full queue
+    std::vector<size_t> idle;           // free printers
+    std::vector<Document> printing;     // document of every printer
+    std::vector<size_t> left;           // documents to write by worker
+    std::vector<std::vector<unsigned> > columns;
+
+    double now;
+    double last;                        // time of last queue change
+    std::vector<double> lengths;        // time spent at every length
+    std::vector<double> waits;
+    std::vector<double> latencies;
+    std::vector<double> busy;           // printing time by printer
+
+    // Accounts time spent at current queue length
+    void Account()
+    {
+        if (lengths.size() <= queue.size())
+            lengths.resize(queue.size() + 1, 0);
+        lengths[queue.size()] += now - last;
+        last = now;
+    }
+
+    void StartWork(size_t worker)
+    {
+        if (left[worker] == 0)
+            return;
+        --left[worker];
+        events.push(Event(now + options->work.Sample(random),
+            WRITTEN, worker));
+    }
+
+    void StartPrint(size_t printer, const Document& document)
+    {
+        printing[printer] = document;
+        waits.push_back(now - document.queued);
+        double time = options->print.Sample(random);
+        busy[printer] += time;
+        events.push(Event(now + time, PRINTED, printer));
+    }
+
+    void Written(size_t worker)
+    {
+        Document document = { worker, now, now };
+        if (!idle.empty())
+        {
+            size_t printer = idle.back();
+            idle.pop_back();
+            StartPrint(printer, document);
+        }
+        else if (queue.size() < qSize)
+        {
+            Account();
+            queue.push_back(document);
+        }
+        else
+        {
+            blocked.push_back(document);
+            return;
+        }
+        StartWork(worker);
+    }
+
+    void Printed(size_t printer)
+    {
+        const Document& done = printing[printer];
+        latencies.push_back(now - done.written);
+        ++columns[printer][done.worker];
+
+        if (queue.empty())
+        {
+            idle.push_back(printer);
+            return;
+        }
+        Account();
+        Document next = queue.front();
+        queue.pop_front();
+        StartPrint(printer, next);
+
+        // Place is free now, first blocked worker goes on
+        if (!blocked.empty())
+        {
+            Document document = blocked.front();
+            blocked.pop_front();
+            document.queued = now;
+            queue.push_back(document);
+            StartWork(document.worker);
+        }
+    }
+
+    // Prints percentiles of sorted values
+    static void Percentiles(std::ostream& out, const char* name,
+        std::vector<double>& values)
+    {
+        std::sort(values.begin(), values.end());
+        static const double levels[] = { 0.5, 0.9, 0.99, 0.999 };
+        out << "[" << name << ":";
+        for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); ++i)
+            out << " p" << levels[i] * 100 << " "
+                << values[(size_t)(levels[i] * (values.size() - 1))];
+        out << " max " << values.back() << " s]" << std::endl;
+    }
+public:
+    Simulation(size_t N, size_t M, size_t K, size_t qSize,
+        const Options* options, uint64_t seed)
+        : N(N), M(M), K(K), qSize(qSize)
+        , options(options)
+        , random(seed)
+        , printing(M)
+        , left(N, K)
+        , columns(M, std::vector<unsigned>(N, 0))
+        , now(0)
+        , last(0)
+        , busy(M, 0)
+    {
+        waits.reserve(N * K);
+        latencies.reserve(N * K);
+        for (size_t j = M; j > 0; --j)
+            idle.push_back(j - 1);
+    }
+
+    // Processes all events
+    void Run()
+    {
+        for (size_t i = 0; i < N; ++i)
+            StartWork(i);
+        while (!events.empty())
+        {
+            Event event = events.top();
+            events.pop();
+            now = event.time;
+            if (event.type == WRITTEN)
+                Written(event.id);
+            else
+                Printed(event.id);
+        }
+        Account();
+    }
+
+    void Report(std::ostream& out, bool table)
+    {
+        if (table)
+        {
+            for (size_t i = 0; i < N; ++i)
+            {
+                out << "| " << std::setw(2) << i << " ||";
+                for (size_t j = 0; j < M; ++j)
+                    out << " " << std::setw(2) << columns[j][i] << " |";
+                out << std::endl;
+            }
+        }
+
+        out << "[" << N * K << " documents in " << now
+            << " s of model time, "
+            << N * K / (now > 0 ? now : 1) << " documents/s]"
+            << std::endl;
+        if (latencies.empty())
+            return;
+        Percentiles(out, "Queue wait", waits);
+        Percentiles(out, "Latency", latencies);
+
+        // Time-weighted queue length
+        double mean = 0, total = 0;
+        for (size_t n = 0; n < lengths.size(); ++n)
+        {
+            mean += n * lengths[n];
+            total += lengths[n];
+        }
+        out << "[Queue length: mean " << mean / (total > 0 ? total : 1);
+        static const double levels[] = { 0.5, 0.9, 0.99 };
+        double sum = 0;
+        size_t n = 0;
+        for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); ++i)
+        {
+            while (n + 1 < lengths.size()
+                && sum + lengths[n] < levels[i] * total)
+                sum += lengths[n++];
+            out << " p" << levels[i] * 100 << " " << n;
+        }
+        out << " max " << lengths.size() - 1 << "]" << std::endl;
+
+        for (size_t j = 0; j < M; ++j)
+            out << "[Printer " << std::setw(3) << j << ": "
+                << (int)(100 * busy[j] / (now > 0 ? now : 1))
+                << "% busy]" << std::endl;
+    }
+};
+
 /**
  * Entry point
  * @param argc
@@ -276,55 +3066,295 @@ void* printer(void* t)
  */
 int main(int argc, char** argv)
 {
-    if (argc != 5)
+    Options options;
+    const char* queue = "mutex";
+    const char* output = NULL;
+    Logger::Level level = Logger::DEBUG;
+    StealingQueue::Distribution distribution = StealingQueue::ROUND_ROBIN;
+    bool simulate = false;
+    int64_t interval = 0;
+    bool coroutines = false;
+    size_t threads = 0;
+    const char* cpulist = NULL;
+    std::vector<double> weights;
+    std::vector<double> deadlines;
+    Placement::Policy policy = Placement::NONE;
+
+    TRACE_INIT("office");
+
+    int opt;
+    while ((opt = getopt(argc, argv, "q:d:B:l:o:w:p:r:t:j:c:a:P:C:D:bs")) != -1)
+    {
+        switch (opt)
+        {
+        case 'q':
+            queue = optarg;
+            break;
+        case 'd':
+            if (!std::strcmp(optarg, "affinity"))
+                distribution = StealingQueue::AFFINITY;
+            else if (std::strcmp(optarg, "rr"))
+                exit(EXIT_FAILURE);
+            break;
+        case 'B':
+            options.batch = std::max(1UL, strtoul(optarg, NULL, 0));
+            break;
+        case 'b':
+            options.work = Distribution(0);
+            options.print = Distribution(0);
+            level = Logger::OFF;
+            break;
+        case 'l':
+            if (!Logger::ParseLevel(optarg, level))
+                exit(EXIT_FAILURE);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'w':
+            if (!options.work.Parse(optarg))
+                exit(EXIT_FAILURE);
+            break;
+        case 'p':
+            if (!options.print.Parse(optarg))
+                exit(EXIT_FAILURE);
+            break;
+        case 'r':
+            options.seed = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            simulate = true;
+            break;
+        case 't':
+            interval = std::max(1L, strtol(optarg, NULL, 0)) * 1000;
+            break;
+        case 'j':
+            options.json = optarg;
+            break;
+        case 'a':
+            cpulist = optarg;
+            if (policy == Placement::NONE)
+                policy = Placement::COMPACT;
+            break;
+        case 'P':
+            if (!Placement::ParsePolicy(optarg, policy))
+                exit(EXIT_FAILURE);
+            break;
+        case 'C':
+            if (!Catalog::ParseList(optarg, weights))
+                exit(EXIT_FAILURE);
+            break;
+        case 'D':
+            if (!Catalog::ParseList(optarg, deadlines))
+                exit(EXIT_FAILURE);
+            break;
+        case 'c':
+            coroutines = true;
+            threads = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind != 4
+        || (std::strcmp(queue, "mutex") && std::strcmp(queue, "ring")
+            && std::strcmp(queue, "steal") && std::strcmp(queue, "node")
+            && std::strcmp(queue, "priority")))
     {
         std::cerr << "Syntax error" << std::endl
             << "Parameters are sizes of: workers printers documents queue"
+            << std::endl
+            << "Options: -q queue           mutex, ring, steal, node or priority"
+            << std::endl
+            << "         -d rr|affinity     distribution for steal"
+            << std::endl
+            << "         -B size            documents moved at once" << std::endl
+            << "         -l off|info|debug  events to log" << std::endl
+            << "         -o file            log file instead of stdout"
+            << std::endl
+            << "         -w dist, -p dist   work and print times, dist is"
+            << std::endl
+            << "                            const:T, exp:MEAN,"
+            << std::endl
+            << "                            lognormal:MEAN,SIGMA, empirical:FILE"
+            << std::endl
+            << "         -r seed            seed of service times" << std::endl
+            << "         -s                 discrete-event simulation"
+            << std::endl
+            << "         -t ms              telemetry sampled with period"
+            << std::endl
+            << "         -j file            telemetry in JSON too" << std::endl
+            << "         -a cpus            CPU list like 0-3,8 for threads"
+            << std::endl
+            << "         -P policy          placement: none, compact or node"
+            << std::endl
+            << "         -C weights         classes of documents like 1,9,"
+            << std::endl
+            << "                            class 0 is the most urgent"
+            << std::endl
+            << "         -D seconds         deadlines of classes, 0 is none"
+            << std::endl
+            << "         -c threads         workers and printers are coroutines"
+            << std::endl
+            << "                            on pool, 0 is thread per core"
+            << std::endl
+            << "         -b                 benchmark, no delays and messages"
             << std::endl;
         exit(EXIT_FAILURE);
     }
 
-    size_t N = strtoul(argv[1], NULL, 0);
-    size_t M = strtoul(argv[2], NULL, 0);
-    size_t K = strtoul(argv[3], NULL, 0);
-    size_t qSize = strtoul(argv[4], NULL, 0);
+    size_t N = strtoul(argv[optind], NULL, 0);
+    size_t M = strtoul(argv[optind + 1], NULL, 0);
+    size_t K = strtoul(argv[optind + 2], NULL, 0);
+    size_t qSize = strtoul(argv[optind + 3], NULL, 0);
+    if (qSize < 1)
+    {
+        std::cerr << "Syntax error: queue size must be positive" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (coroutines && threads == 0)
+        threads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+
+    Topology topology;
+    std::vector<int> allowed;
+    if (cpulist && (!Topology::ParseList(cpulist, allowed)
+        || !topology.Restrict(allowed)))
+    {
+        std::cerr << "Error in CPU list " << cpulist << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    Placement placement(policy, &topology);
+    options.placement = &placement;
+
+    if (!deadlines.empty() && weights.empty())
+        weights.resize(deadlines.size(), 1);
+    if (!weights.empty())
+        options.catalog = new Catalog(weights, deadlines, N * K);
+    else if (!std::strcmp(queue, "priority"))
+        options.catalog = new Catalog(std::vector<double>(1, 1),
+            deadlines, N * K);
+
+    if (simulate)
+    {
+        int64_t start = Now();
+        Simulation simulation(N, M, K, qSize,
+            &options, options.seed);
+        simulation.Run();
+        simulation.Report(std::cout, level >= Logger::INFO);
+        std::cout << "[Simulated in " << Now() - start << " us]"
+            << std::endl;
+        return 0;
+    }
 
     Table* table = new Table(N, M, K);
-    Queue* q = new Queue(qSize);
 
     std::cout << "Office was opened" << std::endl;
+    int fd = STDOUT_FILENO;
+    if (output && (fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    {
+        std::cerr << "Error in opening log " << output << " (Error "
+            << errno << ": " << std::strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    options.log = new Logger(level, fd, coroutines ? threads : N + M);
+
+    Scheduler* scheduler = NULL;
+    StealingQueue* hub = NULL;
+    NodeQueue* nodes = NULL;
+    Queue* q;
+    if (coroutines)
+    {
+        scheduler = new Scheduler(options.log);
+        q = new CoQueue(qSize, scheduler);
+    }
+    else if (!std::strcmp(queue, "steal"))
+    {
+        hub = new StealingQueue(N, M, K, qSize, distribution);
+        q = hub->GetPort(0);
+    }
+    else if (!std::strcmp(queue, "priority"))
+        q = new PriorityQueue(qSize, ClassStorage(options.catalog));
+    else if (!std::strcmp(queue, "node"))
+    {
+        nodes = new NodeQueue(qSize, placement);
+        q = nodes->GetPort(0);
+    }
+    else if (!std::strcmp(queue, "ring"))
+        q = new RingQueue(qSize);
+    else
+        q = new MutexQueue(qSize);
+
+    if (interval || options.json || options.catalog)
+        options.telemetry = new Telemetry(N * K, q,
+            interval ? interval : TELEMETRY_PERIOD, options.catalog);
+    options.start = Now();
+
+    if (coroutines)
+    {
+        CoOffice office = { scheduler, static_cast<CoQueue*>(q), table,
+            &options };
+        for (size_t i = 0; i < N; i++)
+            scheduler->Ready(new CoWorker(&office, i));
+        for (size_t i = 0; i < M; i++)
+            scheduler->Ready(new CoPrinter(&office, i));
+
+        int error = scheduler->Start(threads);
+        if (error != 0)
+        {
+            std::cerr << "Error in creating scheduler threads (Error "
+                << error << ": " << std::strerror(error) << std::endl;
+            std::exit(EXIT_FAILURE);
+        }
+        scheduler->Join();
+        Close(table, q, &options);
+        return 0;
+    }
 
     std::vector<pthread_t> workers(N);
     std::vector<Task*> workersTasks(N);
     std::vector<pthread_t> printers(M);
     std::vector<Task*> printersTasks(M);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
 
     for (size_t i = 0; i < N; i++)
     {
-        workersTasks[i] = new Task(table, q, i, printersTasks);
-        if (pthread_create(&workers[i], 0, worker,
-            (void*)workersTasks[i]) == -1)
+        Queue* port = nodes ? nodes->GetPort(i, i) : q;
+        workersTasks[i] = new Task(table, port, i, printersTasks, &options);
+        int error = placement.Apply(&attr, i, i);
+        if (error == 0)
+            error = pthread_create(&workers[i], &attr, worker,
+                (void*)workersTasks[i]);
+        if (error != 0)
         {
             std::cerr << "Error in creating thread for "
                 << i << " worker (Error " 
-                << errno << ": " << std::strerror(errno) << std::endl;
-            std::exit(EXIT_SUCCESS);
+                << error << ": " << std::strerror(error) << std::endl;
+            std::exit(EXIT_FAILURE);
         }
     }
 
     for (size_t i = 0; i < M; i++)
     {
-        printersTasks[i] = new Task(table, q, i, printersTasks);
-        if (pthread_create(&printers[i], 0, printer,
-            (void*)printersTasks[i]) == -1)
+        Queue* port = hub ? hub->GetPort(i)
+            : nodes ? nodes->GetPort(N + i, i) : q;
+        printersTasks[i] = new Task(table, port, i, printersTasks, &options);
+        int error = placement.Apply(&attr, N + i, i);
+        if (error == 0)
+            error = pthread_create(&printers[i], &attr, printer,
+                (void*)printersTasks[i]);
+        if (error != 0)
         {
             std::cerr << "Error in creating thread for "
                 << i << " printer (Error " 
-                << errno << ": " << std::strerror(errno) << std::endl;
+                << error << ": " << std::strerror(error) << std::endl;
             std::exit(EXIT_FAILURE);
         }
     }
 
+    pthread_attr_destroy(&attr);
+
     for (size_t i = 0; i < N; i++)
     {
         pthread_join(workers[i], NULL);
@@ -0,0 +1,258 @@
+/**
+ * trace.h
+ *
+ * Tracing of tools: per-thread rings of timestamped events which are
+ * dumped to Chrome trace JSON (chrome://tracing, ui.perfetto.dev) on exit
+ *
+ * Tracing is compiled in with -DTRACE only ('make TRACE=1'),
+ * otherwise every macro is empty and arguments are not evaluated.
+ * With -DTRACE_SDT ('make TRACE=sdt') every event is also a USDT probe
+ * of provider TRACE_PROVIDER, so it may be attached by perf or bpftrace.
+ *
+ * Usage:
+ *   TRACE_INIT("tool")           - at start of main, before threads and forks
+ *   TRACE_BEGIN(event)           - start of duration on current thread
+ *   TRACE_END(event)             - end of duration on current thread
+ *   TRACE_EVENT(event, value)    - instant event with integer argument
+ *   TRACE_COUNTER(event, value)  - value of counter
+ * Events are identifiers: TRACE_EVENT(signal_sent, signo)
+ *
+ * Every process writes <tool>.<pid>.json to directory from TRACE_DIR
+ * environment variable or to current one. Timestamps are taken from
+ * monotonic clock, so files of forked processes may be merged.
+ * Forked child starts with empty rings, process replaced by exec or
+ * finished by _exit writes nothing.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef TRACE
+
+/* C generic */
+#include <stdio.h>        /* fopen, fprintf, snprintf */
+#include <stdlib.h>       /* calloc, atexit, getenv */
+#include <string.h>       /* strerror */
+#include <errno.h>        /* errno */
+
+/* POSIX generic */
+#include <time.h>         /* clock_gettime */
+#include <unistd.h>       /* getpid, syscall */
+#include <pthread.h>      /* pthread_atfork */
+
+/* Linux specific */
+#include <sys/syscall.h>  /* SYS_gettid */
+
+#ifdef TRACE_SDT
+#include <sys/sdt.h>      /* DTRACE_PROBE1 */
+#ifndef TRACE_PROVIDER
+#define TRACE_PROVIDER tools
+#endif
+#define TRACE_PROBE(event, value) DTRACE_PROBE1(TRACE_PROVIDER, event, value)
+#else
+#define TRACE_PROBE(event, value) do { } while (0)
+#endif
+
+#ifndef TRACE_RING
+#define TRACE_RING 65536  /* events per thread, power of 2 */
+#endif
+#define TRACE_PATH 4096   /* length of trace file name */
+
+/**
+ * Event of trace
+ */
+struct trace_event
+{
+    const char* name;     /* literal name of event */
+    double ts;            /* monotonic time in microseconds */
+    long value;           /* argument of event */
+    char phase;           /* Chrome trace phase: B, E, i or C */
+};
+
+/**
+ * Ring of one thread, the oldest events are overwritten
+ */
+struct trace_ring
+{
+    struct trace_event events[TRACE_RING];
+    unsigned long head;          /* number of recorded events */
+    long tid;                    /* thread id */
+    struct trace_ring* next;     /* next ring of process */
+};
+
+static struct trace_ring* trace_rings __attribute__((unused)) = NULL;
+static __thread struct trace_ring* trace_own __attribute__((unused)) = NULL;
+static const char* trace_name __attribute__((unused)) = NULL;
+static int trace_pid __attribute__((unused)) = 0;
+
+/**
+ * Reads monotonic clock
+ * @return time in microseconds
+ */
+static __inline__ double trace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * Ring of current thread, created and registered on first use
+ * @return ring or NULL if memory is over
+ */
+static __inline__ struct trace_ring* trace_thread(void)
+{
+    struct trace_ring* ring = trace_own;
+    if (ring != NULL)
+        return ring;
+
+    ring = (struct trace_ring*)calloc(1, sizeof(struct trace_ring));
+    if (ring == NULL)
+        return NULL;
+    ring->tid = syscall(SYS_gettid);
+    do
+        ring->next = trace_rings;
+    while (!__sync_bool_compare_and_swap(&trace_rings, ring->next, ring));
+    trace_own = ring;
+    return ring;
+}
+
+/**
+ * Records event to ring of current thread
+ * @param name literal name of event
+ * @param phase Chrome trace phase
+ * @param value argument of event
+ */
+static __inline__ void trace_record(const char* name, char phase, long value)
+{
+    struct trace_ring* ring;
+    struct trace_event* event;
+
+    if (trace_name == NULL)
+        return;
+    ring = trace_thread();
+    if (ring == NULL)
+        return;
+
+    event = &ring->events[ring->head & (TRACE_RING - 1)];
+    event->name = name;
+    event->ts = trace_now();
+    event->value = value;
+    event->phase = phase;
+    ring->head++;
+}
+
+/**
+ * Drops events of parent in forked child, only calling thread survives
+ */
+static void trace_child(void)
+{
+    struct trace_ring* ring;
+    trace_pid = getpid();
+    for (ring = trace_rings; ring != NULL; ring = ring->next)
+        ring->head = 0;
+    if (trace_own != NULL)
+        trace_own->tid = trace_pid;
+}
+
+/**
+ * Writes all rings of process to Chrome trace JSON
+ */
+static void trace_dump(void)
+{
+    char path[TRACE_PATH];
+    const char* dir = getenv("TRACE_DIR");
+    struct trace_ring* ring;
+    FILE* file;
+
+    snprintf(path, TRACE_PATH, "%s/%s.%d.json",
+        dir != NULL ? dir : ".", trace_name, trace_pid);
+    file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error in creating trace %s (Error %d: %s)\n",
+            path, errno, strerror(errno));
+        return;
+    }
+
+    fprintf(file, "{\"traceEvents\":[\n"
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+        "\"args\":{\"name\":\"%s\"}}", trace_pid, trace_name);
+
+    for (ring = trace_rings; ring != NULL; ring = ring->next)
+    {
+        unsigned long i = 0;
+        unsigned long depth = 0;     /* durations open in dumped events */
+        if (ring->head > TRACE_RING)
+        {
+            i = ring->head - TRACE_RING;
+            fprintf(stderr, "[trace: %lu events of thread %ld are lost]\n",
+                i, ring->tid);
+        }
+
+        for (; i < ring->head; ++i)
+        {
+            struct trace_event* event = &ring->events[i & (TRACE_RING - 1)];
+
+            /* Durations nest on thread, so end without begin in wrapped
+               ring closes one which begin is lost */
+            if (event->phase == 'B')
+                depth++;
+            else if (event->phase == 'E' && depth-- == 0)
+            {
+                depth = 0;
+                continue;
+            }
+            fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                "\"pid\":%d,\"tid\":%ld", event->name, event->phase,
+                event->ts, trace_pid, ring->tid);
+            if (event->phase == 'i')
+                fprintf(file, ",\"s\":\"t\"");
+            if (event->phase != 'E')
+                fprintf(file, ",\"args\":{\"value\":%ld}", event->value);
+            fprintf(file, "}");
+        }
+    }
+
+    fprintf(file, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    fclose(file);
+}
+
+/**
+ * Starts tracing of process
+ * @param name name of tool
+ */
+static __inline__ void trace_init(const char* name)
+{
+    trace_pid = getpid();
+    trace_name = name;
+    trace_thread();
+    pthread_atfork(NULL, NULL, &trace_child);
+    atexit(&trace_dump);
+}
+
+#define TRACE_INIT(name) trace_init(name)
+#define TRACE_BEGIN(event) \
+    do { TRACE_PROBE(event##_begin, 0); \
+         trace_record(#event, 'B', 0); } while (0)
+#define TRACE_END(event) \
+    do { TRACE_PROBE(event##_end, 0); \
+         trace_record(#event, 'E', 0); } while (0)
+#define TRACE_EVENT(event, value) \
+    do { TRACE_PROBE(event, (long)(value)); \
+         trace_record(#event, 'i', (long)(value)); } while (0)
+#define TRACE_COUNTER(event, value) \
+    do { TRACE_PROBE(event, (long)(value)); \
+         trace_record(#event, 'C', (long)(value)); } while (0)
+
+#else
+
+#define TRACE_INIT(name) ((void)0)
+#define TRACE_BEGIN(event) ((void)0)
+#define TRACE_END(event) ((void)0)
+#define TRACE_EVENT(event, value) ((void)sizeof(value))
+#define TRACE_COUNTER(event, value) ((void)sizeof(value))
+
+#endif
+
+#endif /* TRACE_H */
@@ -12,165 +12,1620 @@
  */
 
 // C generic
-#include <cstdio>       // FILE, fopen, fclose
-#include <cstdlib>      // exit, system, strtoul, malloc, realloc
+#include <cstdio>       // sprintf
+#include <cstdlib>      // exit, strtod, malloc, realloc
 #include <cstring>      // strerror, strncpy, strlen, strtok
-#include <ctime>        // time
 #include <cerrno>       // errno2
+#include <stdint.h>     // int64_t
 
 // C++ generic
 #include <iostream>
-#include <list>
+#include <vector>
+#include <deque>
 #include <algorithm>
+#include <functional>
+#include <string>
+#include <map>
+#include <tr1/unordered_map>
 
 // POSIX generic
 #include <sys/types.h>
+#include <sys/stat.h>    // fstat
+#include <sys/mman.h>    // mmap, mremap
+#include <sys/resource.h> // getrusage
 #include <sys/wait.h>    // waitpid
-#include <unistd.h>      // sleep, fork, execvp
+#include <unistd.h>      // fork, execv, execvp, read
+#include <fcntl.h>       // open
+#include <getopt.h>      // getopt_long
+#include <spawn.h>       // posix_spawn
+#include <sys/socket.h>  // socketpair, sendmsg, recv
+#include <signal.h>      // sigprocmask
+#include <poll.h>        // poll
+#include <time.h>        // clock_gettime
 
-#define STDSIZE 256
+// Linux specific
+#include <sys/timerfd.h>  // timerfd_create, timerfd_settime
+#include <sys/signalfd.h> // signalfd
+#include <sys/prctl.h>    // prctl
+
+// Tools
+#include "trace.h"        // TRACE_INIT, TRACE_EVENT
+
+#define STDSIZE 65536   // input read chunk
+#define PATH_CHECK 100000   // us between checks of PATH directories
+
+/**
+ * Reads monotonic clock
+ * @return time in microseconds
+ */
+static inline int64_t Now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Time interval in microseconds printed as seconds with milliseconds
+ */
+struct Seconds
+{
+    int64_t us;
+    explicit Seconds(int64_t us) : us(us) { }
+};
+
+std::ostream& operator<<(std::ostream& out, const Seconds& what)
+{
+    int64_t ms = what.us / 1000;
+    char buf[32];
+    sprintf(buf, "%ld.%03ld", (long)(ms / 1000), (long)(ms % 1000));
+    return out << buf;
+}
+
+/**
+ * Parses delay column, fractional seconds are allowed
+ * @param token delay column
+ * @return delay in milliseconds, -1 on error
+ */
+int ParseDelay(const char* token)
+{
+    char* end;
+    double seconds = strtod(token, &end);
+    return (*end == '\0' && seconds >= 0)
+         ? (int)(seconds * 1000 + 0.5)
+         : -1;
+}
+
+/**
+ * Command record
+ *
+ * Records are fixed-size and kept in one array, records of finished
+ * tasks are reused. Arguments live in the string arena of CommandList
+ */
+struct Task
+{
+    enum State { PENDING, RUNNING, FINISHED };
+
+    int delay;          // delay in milliseconds
+    uint32_t number;    // number of task in input
+    uint32_t argv;      // offset of the first argument in arena
+    uint16_t argc;      // amount of arguments
+    uint16_t state;     // State value
+};
+
+/**
+ * Parameters and state of periodic task
+ *
+ * Only tasks with interval have this record, one-shot ones stay small.
+ * Firing k is due at delay + k * interval plus jitter, which is derived
+ * from task index and k, so the schedule is the same after recovery.
+ */
+struct Periodic
+{
+    enum Overlap { SKIP, QUEUE, PARALLEL };
+
+    int interval;       // milliseconds between firings
+    int jitter;         // maximal extra delay of firing, milliseconds
+    uint32_t count;     // amount of firings, 0 is unlimited
+    uint32_t fired;     // firings which are due already
+    uint32_t active;    // instances ready or running
+    uint16_t overlap;   // Overlap value, for firing while instance is active
+    int64_t next;       // tick of armed firing, -1 if not armed
+    std::deque<int64_t> backlog;    // deadlines of queued firings
+
+    Periodic() : interval(0), jitter(0), count(0), fired(0), active(0),
+        overlap(SKIP), next(-1) { }
+
+    // Parses 'key=value' token, returns false if token is not an option
+    // Invalid value resets valid flag
+    bool Parse(const char* token, bool& valid)
+    {
+        const char* value = std::strchr(token, '=');
+        if (value == NULL)
+            return false;
+        std::string key(token, value++);
+
+        char* end;
+        if (key == "interval")
+        {
+            interval = ParseDelay(value);
+            valid &= interval > 0;
+        }
+        else if (key == "jitter")
+        {
+            jitter = ParseDelay(value);
+            valid &= jitter >= 0;
+        }
+        else if (key == "count")
+        {
+            count = strtoul(value, &end, 10);
+            valid &= *end == '\0' && count != 0;
+        }
+        else if (key == "overlap")
+        {
+            if (!std::strcmp(value, "skip"))
+                overlap = SKIP;
+            else if (!std::strcmp(value, "queue"))
+                overlap = QUEUE;
+            else if (!std::strcmp(value, "parallel"))
+                overlap = PARALLEL;
+            else
+                valid = false;
+        }
+        else
+            return false;
+        return true;
+    }
+
+    // Extra delay of firing, hash of task and firing number
+    int Jitter(uint32_t index, uint32_t firing) const
+    {
+        if (jitter == 0)
+            return 0;
+        uint64_t x = ((uint64_t)index << 32 | firing)
+            * UINT64_C(0x9E3779B97F4A7C15);
+        x ^= x >> 31;
+        return (int)(x % ((uint64_t)jitter + 1));
+    }
+};
+
+/**
+ * Append-only journal of dispatches and completions
+ *
+ * The file is mapped to memory, so records survive a crash of the
+ * scheduler as soon as they are stored. Type field is written last
+ * and the first zero type marks the end of journal.
+ */
+class Journal
+{
+public:
+    enum Type { NONE, DISPATCH, FINISH };
+
+    struct Record
+    {
+        uint32_t type;      // Type value
+        uint32_t index;     // number of task in order of input
+        int32_t pid;        // process id
+        int32_t status;     // exit status for FINISH
+        int64_t time;       // microseconds since schedule start
+        uint64_t offset;    // input offset of the first unfinished task
+        uint32_t first;     // number of the first unfinished task
+        uint32_t line;      // line of the first unfinished task
+    };
+private:
+    struct Header
+    {
+        char magic[8];
+        int64_t start;      // schedule start, microseconds since Epoch
+        int64_t reserved[6];
+    };
+
+    int fd;
+    char* map;
+    size_t size;            // size of mapping
+    size_t used;            // bytes of header and records
+
+    std::vector<uint32_t> finished; // recovered completions
+    Record last;                    // last recovered record
+    size_t dispatched;              // recovered dispatches
+
+    static const size_t CHUNK = 1 << 20;
+
+    static int64_t RealNow()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    inline Header* GetHeader() const { return (Header*)map; }
+    inline Record* At(size_t offset) const { return (Record*)(map + offset); }
+
+    bool Grow()
+    {
+        size_t new_size = size * 2;
+        if (ftruncate(fd, new_size) == -1)
+            return false;
+        void* new_map = mremap(map, size, new_size, MREMAP_MAYMOVE);
+        if (new_map == MAP_FAILED)
+            return false;
+        map = (char*)new_map;
+        size = new_size;
+        return true;
+    }
+public:
+    Journal() : fd(-1), map(NULL), size(0), used(0), dispatched(0)
+    {
+        last = Record();
+    }
+
+    // Opens journal, scans existing records
+    // Returns false on error
+    bool Open(const char* name)
+    {
+        fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat info;
+        if (fd == -1 || fstat(fd, &info) == -1)
+            return false;
+
+        bool fresh = info.st_size == 0;
+        size = fresh ? CHUNK : info.st_size;
+        if (fresh && ftruncate(fd, size) == -1)
+            return false;
+
+        void* result = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+        if (result == MAP_FAILED)
+            return false;
+        map = (char*)result;
+
+        if (fresh)
+        {
+            std::memcpy(GetHeader()->magic, "USELESS1", 8);
+            GetHeader()->start = RealNow();
+        }
+        else if (size < sizeof(Header)
+              || std::memcmp(GetHeader()->magic, "USELESS1", 8))
+        {
+            errno = EINVAL;
+            return false;
+        }
+
+        // Single linear pass over records
+        for (used = sizeof(Header);
+             used + sizeof(Record) <= size && At(used)->type != NONE;
+             used += sizeof(Record))
+        {
+            last = *At(used);
+            if (last.type == FINISH)
+                finished.push_back(last.index);
+            else
+                ++dispatched;
+        }
+        return true;
+    }
+
+    // Schedule start on monotonic clock
+    inline int64_t StartTime() const
+    {
+        return Now() - (RealNow() - GetHeader()->start);
+    }
+
+    inline const std::vector<uint32_t>& Finished() const { return finished; }
+    inline const Record& Last() const { return last; }
+    inline size_t Dispatched() const { return dispatched; }
+
+    // Appends record, returns false on error
+    bool Append(const Record& record)
+    {
+        if (used + sizeof(Record) > size && !Grow())
+            return false;
+
+        Record* place = At(used);
+        *place = record;
+        place->type = NONE;
+        __sync_synchronize();
+        place->type = record.type;
+        used += sizeof(Record);
+        return true;
+    }
+
+    ~Journal()
+    {
+        if (map != NULL)
+            munmap(map, size);
+        if (fd != -1)
+            close(fd);
+    }
+};
 
 /**
- * Command struct type
+ * Scheduling statistics
  */
-class Task
+class Stats
 {
 private:
-    int delay;              // delay
-    char **arguments;       // arguments
-    size_t arg_counter;     // amount of arguments
-    int id;                 // assigned pid
-    mutable bool finished;  // if 1, command is finished
+    // Samples are kept for percentiles only, summary needs just totals
+    bool samples;
+    std::vector<int64_t> late;      // start minus deadline
+    std::vector<int64_t> queued;    // time in ready queue
+    std::vector<int64_t> finished;  // finish minus deadline
+    int64_t launched;               // amount of starts
+    int64_t max_late;
+    int64_t sum_late;
+    int64_t max_queued;
+    int64_t sum_queued;
+    int64_t first;                  // first start
+    int64_t last;                   // last start
+
+    static void Percentiles(std::ostream& out, const char* title,
+        std::vector<int64_t>& values)
+    {
+        static const double points[] = { 0.5, 0.9, 0.99, 0.999 };
+        static const char* names[] = { "p50", "p90", "p99", "p99.9" };
+
+        out << "[" << title << ":";
+        if (values.empty())
+        {
+            out << " no samples]" << std::endl;
+            return;
+        }
+        std::sort(values.begin(), values.end());
+        for (size_t i = 0; i < sizeof(points) / sizeof(points[0]); ++i)
+            out << " " << names[i] << " "
+                << values[(size_t)(points[i] * (values.size() - 1))] << ",";
+        out << " max " << values.back() << " us]" << std::endl;
+    }
+public:
+    // Samples for Report are collected only if they are asked for
+    Stats(bool samples)
+        : samples(samples)
+        , launched(0)
+        , max_late(0)
+        , sum_late(0)
+        , max_queued(0)
+        , sum_queued(0)
+        , first(0)
+        , last(0)
+    { }
+
+    void Start(int64_t now, int64_t late, int64_t queued)
+    {
+        if (launched++ == 0)
+            first = now;
+        last = now;
+        max_late = std::max(max_late, late);
+        sum_late += late;
+        max_queued = std::max(max_queued, queued);
+        sum_queued += queued;
+        if (samples)
+        {
+            this->late.push_back(late);
+            this->queued.push_back(queued);
+        }
+    }
+
+    inline void Finish(int64_t latency)
+    {
+        if (samples)
+            finished.push_back(latency);
+    }
+
+    // Short summary of lateness
+    void Summary(std::ostream& out, size_t max_parallel) const
+    {
+        out << "[Dispatch lateness: max " << max_late << " us, average "
+            << (launched == 0 ? 0 : sum_late / launched)
+            << " us over " << launched << " tasks]" << std::endl;
+        if (max_parallel != 0)
+            out << "[Queue delay: max " << max_queued << " us, average "
+                << (launched == 0 ? 0 : sum_queued / launched)
+                << " us with " << max_parallel << " slots]" << std::endl;
+    }
+
+    // Percentiles, throughput and resource usage
+    void Report(std::ostream& out)
+    {
+        Percentiles(out, "Dispatch lateness", late);
+        Percentiles(out, "Queue delay", queued);
+        Percentiles(out, "Finish after deadline", finished);
+
+        int64_t span = last - first;
+        out << "[Throughput: " << launched << " tasks started in "
+            << Seconds(span) << " s";
+        if (span > 0)
+            out << ", " << (int64_t)(launched * 1e6 / span)
+                << " tasks/s";
+        out << "]" << std::endl;
+
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        out << "[Scheduler CPU: user "
+            << Seconds((int64_t)usage.ru_utime.tv_sec * 1000000
+                + usage.ru_utime.tv_usec)
+            << " s, system "
+            << Seconds((int64_t)usage.ru_stime.tv_sec * 1000000
+                + usage.ru_stime.tv_usec)
+            << " s, max RSS " << usage.ru_maxrss << " KiB]" << std::endl;
+    }
+};
+
+/**
+ * Hierarchical timer wheel of task indexes
+ *
+ * Four levels of 256 slots with millisecond tick cover every delay.
+ * Entry is kept at the lowest level where its tick shares higher bytes
+ * with the current tick and is cascaded down when the current tick
+ * reaches its slot, so insertion is O(1) and entry moves at most three
+ * times before it expires. Bitmaps of occupied slots let empty ones be
+ * skipped while advancing and looking for the next deadline.
+ */
+class TimerWheel
+{
+private:
+    typedef std::pair<int64_t, uint32_t> Entry;     // tick and task index
+
+    static const int LEVELS = 4;
+    static const int BITS = 8;
+    static const int SLOTS = 1 << BITS;
+    static const int WORDS = SLOTS / 64;
+
+    std::vector<Entry> slots[LEVELS][SLOTS];
+    uint64_t used[LEVELS][WORDS];   // bitmaps of non-empty slots
+    int64_t current;                // first tick which has not expired
+    size_t count;                   // amount of entries
+
+    // First non-empty slot of level starting from given one, SLOTS if none
+    int NextUsed(int level, int from) const
+    {
+        for (int word = from / 64; word < WORDS; ++word)
+        {
+            uint64_t bits = used[level][word];
+            if (word == from / 64)
+                bits &= ~(uint64_t)0 << (from % 64);
+            if (bits != 0)
+                return word * 64 + __builtin_ctzll(bits);
+        }
+        return SLOTS;
+    }
+
+    void Put(const Entry& entry)
+    {
+        int level = 0;
+        while (level + 1 < LEVELS
+            && (entry.first >> (BITS * (level + 1)))
+               != (current >> (BITS * (level + 1))))
+        {
+            ++level;
+        }
+        int slot = (entry.first >> (BITS * level)) & (SLOTS - 1);
+        slots[level][slot].push_back(entry);
+        used[level][slot / 64] |= (uint64_t)1 << (slot % 64);
+    }
+
+    // Moves entries of the slot current tick has reached to lower levels
+    void Cascade()
+    {
+        for (int level = 1; level < LEVELS; ++level)
+        {
+            int slot = (current >> (BITS * level)) & (SLOTS - 1);
+            std::vector<Entry> moved;
+            moved.swap(slots[level][slot]);
+            used[level][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+            for (size_t i = 0; i < moved.size(); ++i)
+                Put(moved[i]);
+            if (slot != 0)
+                break;
+        }
+    }
+public:
+    TimerWheel() : current(0), count(0)
+    {
+        std::memset(used, 0, sizeof(used));
+    }
+
+    // Adds task, ticks which have expired already are due on next advance
+    void Insert(int64_t tick, uint32_t index)
+    {
+        Put(Entry(std::max(tick, current), index));
+        ++count;
+    }
+
+    // Appends tasks which ticks are not later than now in order of ticks
+    void Advance(int64_t now, std::vector<uint32_t>& due)
+    {
+        while (current <= now)
+        {
+            int64_t base = current & ~(int64_t)(SLOTS - 1);
+            int slot = NextUsed(0, current & (SLOTS - 1));
+            if (slot < SLOTS && base + slot <= now)
+            {
+                std::vector<Entry>& entries = slots[0][slot];
+                for (size_t i = 0; i < entries.size(); ++i)
+                    due.push_back(entries[i].second);
+                count -= entries.size();
+                entries.clear();
+                used[0][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+                current = base + slot + 1;
+            }
+            else
+            {
+                // Empty slots are skipped up to the next occupied one
+                int64_t next = Next();
+                current = next == -1 ? now + 1 : std::min(now + 1, next);
+            }
+
+            if ((current & (SLOTS - 1)) == 0)
+                Cascade();
+        }
+    }
+
+    // Lower bound of the next tick to expire, -1 if wheel is empty
+    int64_t Next() const
+    {
+        if (count == 0)
+            return -1;
+
+        int slot = NextUsed(0, current & (SLOTS - 1));
+        if (slot < SLOTS)
+            return (current & ~(int64_t)(SLOTS - 1)) + slot;
+
+        for (int level = 1; level < LEVELS; ++level)
+        {
+            int shift = BITS * level;
+            int from = ((current >> shift) & (SLOTS - 1)) + 1;
+            slot = from < SLOTS ? NextUsed(level, from) : SLOTS;
+            if (slot < SLOTS)
+                return ((current >> (shift + BITS)) << (shift + BITS))
+                    + ((int64_t)slot << shift);
+        }
+
+        // Ticks beyond the top level wrap to its first slots
+        return ((current >> (BITS * LEVELS)) + 1) << (BITS * LEVELS);
+    }
+
+    // Removes every entry which task matches predicate
+    template<typename Predicate>
+    void Erase(Predicate drop)
+    {
+        for (int level = 0; level < LEVELS; ++level)
+            for (int slot = 0; slot < SLOTS; ++slot)
+            {
+                std::vector<Entry>& entries = slots[level][slot];
+                size_t kept = 0;
+                for (size_t i = 0; i < entries.size(); ++i)
+                    if (!drop(entries[i].second))
+                        entries[kept++] = entries[i];
+                count -= entries.size() - kept;
+                entries.resize(kept);
+                if (kept == 0)
+                    used[level][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+            }
+    }
+
+    inline bool Empty() const { return count == 0; }
+    inline size_t Size() const { return count; }
+};
+
+/**
+ * Commands scheduled and running
+ *
+ * Pending tasks are kept in timer wheel by their start tick in
+ * milliseconds since schedule start, so new lines can be added while
+ * the earliest ones are started. Index is the number of task in order
+ * of input. Periodic task has one entry in the wheel which is re-armed
+ * after each firing, so memory depends on amount of tasks, not firings.
+ */
+class CommandList
+{
+private:
+    // Due instance of task
+    struct Due
+    {
+        int64_t since;      // time it became due
+        int64_t deadline;   // time it should have been started
+        uint32_t index;     // task
+        Due(int64_t since, int64_t deadline, uint32_t index)
+            : since(since), deadline(deadline), index(index) { }
+    };
+    // Running instance of task
+    struct Instance
+    {
+        uint32_t index;     // task
+        int64_t deadline;   // time it should have been started
+    };
+    typedef std::tr1::unordered_map<int, Instance> RunningMap;
+    typedef std::tr1::unordered_map<uint32_t, Periodic> PeriodicMap;
+
+    // Matches every task
+    struct IsAny
+    {
+        bool operator()(uint32_t) const { return true; }
+    };
+
+    // Matches armed periodic tasks
+    struct IsPeriodic
+    {
+        const PeriodicMap* periodic;
+        bool operator()(uint32_t index) const
+        {
+            return periodic->count(index) != 0;
+        }
+    };
+
+    // Origin of task in input for journal
+    struct Origin
+    {
+        uint64_t offset;    // input offset of line
+        uint32_t line;      // number of line
+        bool finished;
+    };
+
+    std::vector<Task> tasks;        // task records by index
+    std::vector<uint32_t> unused;   // indexes of records to reuse
+    std::vector<char> arena;        // arguments separated by '\0'
+    size_t garbage;                 // arena bytes of released tasks
+    TimerWheel pending;             // tasks to start
+    std::vector<uint32_t> expired;  // tasks taken from wheel
+    std::deque<Due> ready;          // due instances of tasks
+    RunningMap started;             // instances which are running by pid
+    PeriodicMap periodic;           // unfinished periodic tasks
+    std::vector<char> line;         // incomplete line of input
+    bool isValid;
+    int64_t start_time;
+    size_t lines;                   // amount of lines read
+    uint64_t offset;                // input offset after last line
+
+    Stats* stats;
+    bool quiet;                     // no line for every task
+
+    // Journal support
+    Journal* journal;
+    uint32_t base;                  // number of the first task of input
+    uint32_t parsed;                // tasks parsed after base
+    std::vector<char> done;         // finished before recovery
+    std::deque<Origin> origins;     // tasks from watermark on
+    uint32_t watermark;             // number of first unfinished task
+
+    // Periodic tasks
+    bool stopped;                   // periodic tasks are not re-armed
+    size_t firings;                 // instances of periodic tasks due
+    size_t skipped;                 // firings dropped by overlap policy
+    size_t missed;                  // firings passed while not running
+
+    // Moves arguments of live tasks to the start of arena
+    // when most of it belongs to released ones
+    void Compact()
+    {
+        if (garbage < STDSIZE || garbage * 2 < arena.size())
+            return;
+
+        std::vector<char> packed;
+        packed.reserve(arena.size() - garbage);
+        for (size_t i = 0; i < tasks.size(); ++i)
+        {
+            Task& task = tasks[i];
+            if (task.argc == 0)
+                continue;
+            size_t size = ArgumentsSize(task);
+            uint32_t moved = packed.size();
+            packed.insert(packed.end(), &arena[task.argv],
+                &arena[task.argv] + size);
+            task.argv = moved;
+        }
+        arena.swap(packed);
+        garbage = 0;
+    }
+
+    // Size of arguments of task in arena
+    size_t ArgumentsSize(const Task& task) const
+    {
+        const char* begin = &arena[task.argv];
+        const char* end = begin;
+        for (size_t i = 0; i < task.argc; ++i)
+            end += strlen(end) + 1;
+        return end - begin;
+    }
+
+    // Returns record of finished task for reuse
+    void Release(uint32_t index)
+    {
+        garbage += ArgumentsSize(tasks[index]);
+        tasks[index].argc = 0;
+        unused.push_back(index);
+    }
+
+    void Parse(char* text, uint64_t origin)
+    {
+        ++lines;
+        char* token = strtok(text, " \n");
+
+        // Empty line
+        if (token == NULL)
+            return;
+
+        Compact();
+        Task task;
+        task.delay = ParseDelay(token);
+        task.number = base + parsed;
+        task.argv = arena.size();
+        task.argc = 0;
+        task.state = Task::PENDING;
+
+        if (task.delay < 0)
+        {
+            std::cerr << "Invalid delay value in line " << lines << "\n";
+            isValid = false;
+            return;
+        }
+
+        // Options of periodic task precede the command
+        Periodic job;
+        bool valid = true;
+        while ((token = strtok(NULL, " \n")) != NULL && job.Parse(token, valid))
+        {
+        }
+        if (!valid || (job.interval == 0
+            && (job.count != 0 || job.jitter != 0)))
+        {
+            std::cerr << "Invalid periodic options in line " << lines << "\n";
+            isValid = false;
+            return;
+        }
+
+        for (; token != NULL; token = strtok(NULL, " \n"))
+        {
+            arena.insert(arena.end(), token, token + strlen(token) + 1);
+            ++task.argc;
+        }
+
+        // Line with delay only
+        if (task.argc == 0)
+        {
+            arena.resize(task.argv);
+            return;
+        }
+
+        if (journal != NULL)
+        {
+            // Task finished before recovery gets no record
+            Origin entry = { origin, (uint32_t)lines - 1, false };
+            entry.finished = parsed < done.size() && done[parsed];
+            origins.push_back(entry);
+            ++parsed;
+            if (entry.finished)
+            {
+                arena.resize(task.argv);
+                Advance();
+                return;
+            }
+        }
+        else
+            ++parsed;
+
+        uint32_t index;
+        if (unused.empty())
+        {
+            index = tasks.size();
+            tasks.push_back(task);
+        }
+        else {
+            index = unused.back();
+            unused.pop_back();
+            tasks[index] = task;
+        }
+        if (job.interval == 0)
+        {
+            pending.Insert(task.delay, index);
+            return;
+        }
+
+        Periodic& added = periodic[index];
+        added = job;
+        Arm(index, added, Now());
+    }
+
+    // Arms the next firing of periodic task
+    // Firings which have passed completely are not repeated: after
+    // recovery or a long stall only the latest of them is due
+    void Arm(uint32_t index, Periodic& job, int64_t now)
+    {
+        job.next = -1;
+        if (stopped || (job.count != 0 && job.fired >= job.count))
+            return;
+
+        int64_t tick = (now - start_time) / 1000;
+        int64_t nominal = tasks[index].delay + (int64_t)job.fired * job.interval;
+        if (nominal + job.interval <= tick)
+        {
+            int64_t behind = (tick - nominal) / job.interval;
+            if (job.count != 0)
+                behind = std::min(behind, (int64_t)(job.count - job.fired));
+            job.fired += behind;
+            missed += behind;
+            nominal += behind * job.interval;
+            if (job.count != 0 && job.fired >= job.count)
+                return;
+        }
+
+        job.next = nominal + job.Jitter(index, job.fired);
+        pending.Insert(job.next, index);
+    }
+
+    // Handles firing of periodic task taken from wheel
+    void Fire(uint32_t index, Periodic& job, int64_t now)
+    {
+        int64_t deadline = start_time + job.next * 1000;
+        ++job.fired;
+        ++firings;
+        Arm(index, job, now);
+
+        if (job.active == 0 || job.overlap == Periodic::PARALLEL)
+        {
+            ++job.active;
+            ready.push_back(Due(now, deadline, index));
+        }
+        else if (job.overlap == Periodic::QUEUE)
+            job.backlog.push_back(deadline);
+        else
+        {
+            ++skipped;
+            if (!quiet)
+                std::cout << "[Command '" << Name(index) << "' skipped at "
+                    << Seconds(deadline - start_time)
+                    << ", previous one is running]" << std::endl;
+        }
+    }
+
+    // Completes instance of task, periodic one is finished with its last
+    // Record stays readable till the next line is parsed
+    void Complete(uint32_t index, int pid, int status)
+    {
+        PeriodicMap::iterator it = periodic.find(index);
+        if (it != periodic.end())
+        {
+            Periodic& job = it->second;
+            --job.active;
+            if (!job.backlog.empty())
+            {
+                ++job.active;
+                ready.push_back(Due(Now(), job.backlog.front(), index));
+                job.backlog.pop_front();
+                return;
+            }
+            if (job.active != 0 || job.next != -1)
+                return;
+
+            // Stopped task is not finished, so it is resumed after recovery
+            bool exhausted = job.count != 0 && job.fired >= job.count;
+            periodic.erase(it);
+            if (!exhausted)
+                return;
+        }
+
+        tasks[index].state = Task::FINISHED;
+        if (journal != NULL)
+        {
+            origins[tasks[index].number - watermark].finished = true;
+            Advance();
+        }
+        Log(Journal::FINISH, index, pid, status);
+        Release(index);
+    }
+
+    // Moves watermark over finished tasks
+    void Advance()
+    {
+        while (!origins.empty() && origins.front().finished)
+        {
+            origins.pop_front();
+            ++watermark;
+        }
+    }
+
+    // Writes record to journal
+    void Log(Journal::Type type, uint32_t index, int pid, int status)
+    {
+        if (journal == NULL)
+            return;
+
+        Journal::Record record = Journal::Record();
+        record.type = type;
+        record.index = tasks[index].number;
+        record.pid = pid;
+        record.status = status;
+        record.time = Now() - start_time;
+        record.first = watermark;
+        if (!origins.empty())
+        {
+            record.offset = origins.front().offset;
+            record.line = origins.front().line;
+        }
+        else {
+            record.offset = offset;
+            record.line = lines;
+        }
+
+        if (!journal->Append(record))
+        {
+            std::cerr << "Error in writing journal (Error "
+                << errno << ": " << std::strerror(errno) << std::endl;
+            isValid = false;
+            journal = NULL;
+        }
+    }
 public:
-    Task(char* line) : id(0), finished(false)
+    CommandList(Stats* stats, Journal* journal = NULL)
+        : garbage(0)
+        , isValid(true)
+        , start_time(Now())
+        , lines(0)
+        , offset(0)
+        , stats(stats)
+        , quiet(false)
+        , journal(journal)
+        , base(0)
+        , parsed(0)
+        , watermark(0)
+        , stopped(false)
+        , firings(0)
+        , skipped(0)
+        , missed(0)
+    { }
+
+    // Restores schedule state from journal
+    // Input is positioned to the first unfinished task if possible
+    void Recover(int fd)
     {
-        // -1 column has delay and won't be copied to arguments list
-        int i = -1;
+        if (journal == NULL)
+            return;
+
+        start_time = journal->StartTime();
+
+        // Fresh journal
+        const Journal::Record& last = journal->Last();
+        if (last.type == Journal::NONE)
+            return;
+
+        if (lseek(fd, last.offset, SEEK_SET) != -1)
+        {
+            base = last.first;
+            watermark = base;
+            lines = last.line;
+            offset = last.offset;
+        }
+
+        const std::vector<uint32_t>& finished = journal->Finished();
+        for (size_t i = 0; i < finished.size(); ++i)
+        {
+            if (finished[i] < base)
+                continue;
+            if (finished[i] - base >= done.size())
+                done.resize(finished[i] - base + 1, 0);
+            done[finished[i] - base] = 1;
+        }
+
+        std::cout << "[Recovered " << finished.size() << " finished of "
+            << journal->Dispatched() << " dispatched tasks, skipped "
+            << base << " tasks of input]" << std::endl;
+    }
 
-        char* token = strtok(line, " \n");
+    // Reads available data from descriptor, returns false on EOF
+    bool Read(int fd)
+    {
+        char buf[STDSIZE];
+        ssize_t result = read(fd, buf, STDSIZE);
+        if (result == -1 && (errno == EAGAIN || errno == EINTR))
+            return true;
 
-        arguments = (char**)malloc(sizeof(char*));
+        // Read error handler
+        if (result == -1)
+        {
+            std::cerr << "Error in reading file (Error "
+                << errno << ": " << std::strerror(errno) << std::endl;
+            isValid = false;
+        }
 
-        while (token != NULL)
+        // Last line may be without '\n'
+        if (result <= 0)
         {
-            // Read delay
-            if (i == -1)
+            if (!line.empty())
             {
-                delay = strtoul(token, NULL, 0);
+                uint64_t origin = offset;
+                offset += line.size();
+                line.push_back('\0');
+                Parse(&line[0], origin);
+                line.clear();
             }
-            else {
-                arguments = (char**)realloc(arguments, (i + 1) * sizeof(char*));
-                arguments[i] = (char*)malloc(strlen(token) * sizeof(char));
-                strcpy(arguments[i], token);
+            return false;
+        }
+
+        for (ssize_t i = 0; i < result; ++i)
+        {
+            line.push_back(buf[i]);
+            if (buf[i] == '\n')
+            {
+                uint64_t origin = offset;
+                offset += line.size();
+                line.push_back('\0');
+                Parse(&line[0], origin);
+                line.clear();
             }
+        }
+        return true;
+    }
+
+    // Time to check pending tasks, -1 if there is nothing to run
+    inline int64_t Next() const
+    {
+        int64_t tick = pending.Next();
+        return tick == -1 ? -1 : start_time + tick * 1000;
+    }
 
-            // Next token
-            i++;
-            token = strtok(NULL," \n");
+    // Absolute time to start task
+    inline int64_t Deadline(int index) const
+    {
+        return start_time + (int64_t)tasks[index].delay * 1000;
+    }
+
+    // Delay in milliseconds
+    inline int Delay(int index) const { return tasks[index].delay; }
+
+    // Start of task since schedule start in microseconds,
+    // periodic task is started at time of its first ready firing
+    inline int64_t Offset(int index) const
+    {
+        return !ready.empty() && (int)ready.front().index == index
+            ? ready.front().deadline - start_time
+            : (int64_t)tasks[index].delay * 1000;
+    }
+
+    // Command name
+    inline const char* Name(int index) const
+    {
+        return &arena[tasks[index].argv];
+    }
+
+    // Runs task in current process by resolved path, returns only on error
+    // Stale path falls back to PATH search
+    int Run(int index, const char* path) const
+    {
+        const Task& task = tasks[index];
+        std::vector<char*> argv(task.argc + 1, (char*)NULL);
+        char* arg = const_cast<char*>(&arena[task.argv]);
+        for (size_t i = 0; i < task.argc; ++i)
+        {
+            argv[i] = arg;
+            arg += strlen(arg) + 1;
         }
+        execv(path, &argv[0]);
+        return errno == ENOENT ? execvp(argv[0], &argv[0]) : -1;
+    }
 
-        // Fill last word with NULL for execvp
-        arguments = (char**)realloc(arguments, (i + 1) * sizeof(char*));
-        arguments[i] = NULL;
-        arg_counter = i + 1;
+    // Arguments separated by '\0' and their total size
+    std::pair<const char*, size_t> Arguments(int index) const
+    {
+        const Task& task = tasks[index];
+        return std::make_pair(&arena[task.argv], ArgumentsSize(task));
     }
-    
-    inline void setId(int pid) { this->id = pid; }
-    inline int getDelay() const { return this->delay; }
-    
-    friend std::ostream& operator<<(std::ostream& out, const Task& what);
-    friend bool operator<(const Task& fst, const Task& snd);
-    
-    void Test(int options, int start_time) const
+
+    // Moves tasks which deadline has come to ready queue
+    void Promote(int64_t now)
     {
-        int status = 0;
-        if (!finished && waitpid(id, &status, options))
+        expired.clear();
+        pending.Advance((now - start_time) / 1000, expired);
+        for (size_t i = 0; i < expired.size(); ++i)
         {
-            std::cout << "[Command '" << arguments[0] << "' finished at "
-                << (int)(time(NULL) - start_time) << " with status " << status
-                << "]" << std::endl;
-            finished = true;
+            uint32_t index = expired[i];
+            PeriodicMap::iterator it = periodic.find(index);
+            if (it == periodic.end())
+                ready.push_back(Due(now, Deadline(index), index));
+            else
+                Fire(index, it->second, now);
         }
     }
-    
-    inline int Run() const { return execvp(arguments[0], arguments);}
-    
-    ~Task()
+
+    // Cancels future firings of periodic tasks, instances which are
+    // ready or running are completed as usual
+    void Stop()
+    {
+        stopped = true;
+        IsPeriodic match = { &periodic };
+        pending.Erase(match);
+
+        PeriodicMap::iterator it = periodic.begin();
+        while (it != periodic.end())
+        {
+            it->second.next = -1;
+            it->second.backlog.clear();
+            if (it->second.active == 0)
+                periodic.erase(it++);
+            else
+                ++it;
+        }
+    }
+
+    // Drops every task which is not started yet, running ones are
+    // completed as usual. Dropped tasks are not finished in journal,
+    // so they are resumed after recovery
+    // Returns amount of dropped tasks
+    size_t Cancel()
+    {
+        Stop();
+        size_t dropped = pending.Size() + ready.size();
+        IsAny match;
+        pending.Erase(match);
+
+        for (size_t i = 0; i < ready.size(); ++i)
+        {
+            PeriodicMap::iterator it = periodic.find(ready[i].index);
+            if (it != periodic.end() && --it->second.active == 0)
+                periodic.erase(it);
+        }
+        ready.clear();
+        return dropped;
+    }
+
+    // First ready task, -1 if there is nothing to run
+    inline int Ready() const
+    {
+        return ready.empty() ? -1 : (int)ready.front().index;
+    }
+
+    // Time the first ready task spent in queue
+    inline int64_t Queued(int64_t now) const
+    {
+        return now - ready.front().since;
+    }
+
+    // Time the first ready task is behind its deadline
+    inline int64_t Late(int64_t now) const
+    {
+        return now - ready.front().deadline;
+    }
+
+    // Amount of running tasks
+    inline size_t Running() const { return started.size(); }
+
+    // Moves first ready task to started ones
+    void Start(int pid)
+    {
+        uint32_t index = ready.front().index;
+        Instance running = { index, ready.front().deadline };
+        ready.pop_front();
+
+        tasks[index].state = Task::RUNNING;
+        started[pid] = running;
+        Log(Journal::DISPATCH, index, pid, 0);
+        TRACE_EVENT(task_dispatch, index);
+    }
+
+    // Drops first ready task which could not be started
+    void Fail(int status)
+    {
+        uint32_t index = ready.front().index;
+        ready.pop_front();
+
+        Complete(index, 0, status);
+        TRACE_EVENT(task_fail, index);
+    }
+
+    // Marks task of process as finished
+    // Returns false if process is not ours
+    bool Finish(int pid, int status)
+    {
+        RunningMap::iterator it = started.find(pid);
+        if (it == started.end())
+            return false;
+
+        Instance running = it->second;
+        uint32_t index = running.index;
+        started.erase(it);
+        Complete(index, pid, status);
+        TRACE_EVENT(task_exit, index);
+
+        int64_t now = Now();
+        stats->Finish(now - running.deadline);
+        if (!quiet)
+            std::cout << "[Command '" << Name(index) << "' finished at "
+                << Seconds(now - start_time) << " with status " << status
+                << "]" << std::endl;
+        return true;
+    }
+
+    // Reaps every finished child, WNOHANG doesn't wait for finish
+    // Returns amount of commands finished right now
+    size_t Reap()
+    {
+        size_t result = 0;
+        int status;
+        int pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+            result += Finish(pid, status);
+        return result;
+    }
+
+    inline void SetQuiet(bool value) { quiet = value; }
+    inline bool IsValid() const { return isValid; }
+    inline bool IsIdle() const
+    {
+        return pending.Empty() && ready.empty() && started.empty();
+    }
+
+    // Counters of periodic tasks
+    void Summary(std::ostream& out) const
     {
-        for (size_t j = 0; j < arg_counter - 1; ++j)
-            free(arguments[j]);
-        free(arguments);
+        if (firings + missed == 0)
+            return;
+        out << "[Periodic: " << firings << " firings, " << skipped
+            << " skipped by overlap, " << missed << " missed]" << std::endl;
     }
 };
 
+/**
+ * Printable reference to task
+ */
+struct Command
+{
+    const CommandList& list;
+    int index;
+    Command(const CommandList& list, int index) : list(list), index(index) { }
+};
 
-std::ostream& operator<<(std::ostream& out, const Task& what)
+std::ostream& operator<<(std::ostream& out, const Command& what)
 {
-    out << "'" << what.arguments[0] << "' at " << what.delay;
+    out << "'" << what.list.Name(what.index) << "' at "
+        << Seconds(what.list.Offset(what.index));
     return out;
 }
 
-inline bool operator<(const Task& fst, const Task& snd)
+/**
+ * Cache of commands resolved through PATH, like hash builtin of shell
+ *
+ * Entry is dropped when PATH changes or when mtime of its directory or
+ * of any directory before it changes, since command could appear there
+ * or disappear from its own one. Directories are checked at most once
+ * per PATH_CHECK.
+ */
+class PathCache
 {
-    return fst.delay < snd.delay;
-}
+private:
+    struct Entry
+    {
+        std::string path;
+        size_t dir;         // index of directory in PATH
+    };
+    struct Directory
+    {
+        std::string name;
+        timespec mtime;
+    };
+
+    std::map<std::string, Entry> paths;
+    std::vector<Directory> dirs;
+    std::string variable;   // PATH of last check
+    int64_t checked;        // time of last check, us
+
+    static timespec Mtime(const std::string& dir)
+    {
+        struct stat info;
+        if (stat(dir.c_str(), &info) == -1)
+        {
+            timespec none = { 0, 0 };
+            return none;
+        }
+        return info.st_mtim;
+    }
+
+    // Drops entries which may be stale
+    void Validate()
+    {
+        int64_t now = Now();
+        if (checked != 0 && now - checked < PATH_CHECK)
+            return;
+        checked = now;
+
+        const char* path = getenv("PATH");
+        if (path == NULL)
+            path = "/bin:/usr/bin";
+        if (variable != path)
+        {
+            variable = path;
+            paths.clear();
+            dirs.clear();
+            while (true)
+            {
+                const char* end = std::strchr(path, ':');
+                if (end == NULL)
+                    end = path + strlen(path);
+
+                // Empty element is current directory
+                Directory dir;
+                dir.name.assign(path, end);
+                if (dir.name.empty())
+                    dir.name = ".";
+                dir.mtime = Mtime(dir.name);
+                dirs.push_back(dir);
+                if (*end == '\0')
+                    break;
+                path = end + 1;
+            }
+            return;
+        }
+
+        size_t first = dirs.size();
+        for (size_t i = 0; i < dirs.size(); ++i)
+        {
+            timespec mtime = Mtime(dirs[i].name);
+            if (mtime.tv_sec != dirs[i].mtime.tv_sec
+                || mtime.tv_nsec != dirs[i].mtime.tv_nsec)
+            {
+                dirs[i].mtime = mtime;
+                first = std::min(first, i);
+            }
+        }
+
+        std::map<std::string, Entry>::iterator it = paths.begin();
+        while (first < dirs.size() && it != paths.end())
+        {
+            if (it->second.dir >= first)
+                paths.erase(it++);
+            else
+                ++it;
+        }
+    }
+public:
+    PathCache() : checked(0) { }
+
+    // Forgets path of command which turned out to be stale
+    inline void Drop(const char* name) { paths.erase(name); }
 
-class CommandList : public std::list<Task*>
+    // Returns path to run command, NULL if it is not found
+    const char* Resolve(const char* name)
+    {
+        // Names with slash are not searched
+        if (std::strchr(name, '/') != NULL)
+            return name;
+
+        Validate();
+        std::map<std::string, Entry>::iterator it = paths.find(name);
+        if (it != paths.end())
+            return it->second.path.c_str();
+
+        for (size_t i = 0; i < dirs.size(); ++i)
+        {
+            std::string candidate = dirs[i].name + '/' + name;
+            struct stat info;
+            if (stat(candidate.c_str(), &info) == 0
+                && S_ISREG(info.st_mode)
+                && access(candidate.c_str(), X_OK) == 0)
+            {
+                Entry& entry = paths[name];
+                entry.path = candidate;
+                entry.dir = i;
+                return entry.path.c_str();
+            }
+        }
+        errno = ENOENT;
+        return NULL;
+    }
+};
+
+/**
+ * Pre-forked command spawner
+ *
+ * Helper process is forked before the schedule grows. It receives
+ * arguments over socket pair and starts commands with posix_spawn,
+ * so the big scheduler process is never forked. Helper is the parent
+ * of commands, it reaps them and sends their exit statuses back.
+ */
+class Launcher
 {
-    bool isValid;
-    int start_time;
-    typedef typename std::list<Task*> base;
 public:
-    typedef typename base::iterator iterator;
-    typedef typename base::const_iterator const_iterator;
+    enum Type { SPAWNED, FAILED, EXITED };
+
+    struct Reply
+    {
+        int32_t type;       // Type value
+        uint32_t index;     // number of task
+        int32_t pid;        // process id
+        int32_t value;      // errno for FAILED, status for EXITED
+    };
+private:
+    int fd;
+    int pid;
+    std::deque<Reply> exits;    // exits received while waiting for spawn
 
-    CommandList(FILE* fp) : start_time(time(NULL))
+    // Helper main loop, never returns
+    static void Serve(int fd)
     {
-        char* line = new char[STDSIZE];
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+        // Commands are started with clean signal mask
+        sigset_t empty;
+        sigemptyset(&empty);
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, &empty);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
 
-        // Reading lines and create commands
-        while (fgets(line, STDSIZE, fp) != NULL)
+        PathCache cache;
+        std::vector<char> buf;
+        std::vector<char*> argv;
+
+        while (true)
         {
-            this->push_front(new Task(line));
-            if (this->front()->getDelay() < 0)
+            pollfd fds[2];
+            fds[0].fd = fd;
+            fds[0].events = POLLIN;
+            fds[1].fd = sfd;
+            fds[1].events = POLLIN;
+            if (poll(fds, 2, -1) == -1 && errno != EINTR)
+                _exit(1);
+
+            if (fds[1].revents & POLLIN)
             {
-                std::cerr << "Invalid delay value\n";
-                isValid = false;
-                break;
+                signalfd_siginfo info;
+                while (read(sfd, &info, sizeof(info)) > 0);
+
+                Reply reply = Reply();
+                reply.type = EXITED;
+                while ((reply.pid = waitpid(-1, &reply.value, WNOHANG)) > 0)
+                    send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+            }
+
+            if (!(fds[0].revents & (POLLIN | POLLHUP)))
+                continue;
+
+            // Request is task number and arguments separated by '\0'
+            ssize_t size = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+            if (size <= 0)
+                _exit(size == 0 ? 0 : 1);
+            buf.resize(size + 1);
+            size = recv(fd, &buf[0], size, 0);
+            if (size < (ssize_t)sizeof(uint32_t))
+                _exit(1);
+            buf[size] = '\0';
+
+            Reply reply = Reply();
+            std::memcpy(&reply.index, &buf[0], sizeof(uint32_t));
+
+            argv.clear();
+            for (char* arg = &buf[sizeof(uint32_t)];
+                 arg < &buf[size]; arg += strlen(arg) + 1)
+            {
+                argv.push_back(arg);
             }
+            argv.push_back(NULL);
+
+            // Stale path falls back to PATH search
+            const char* path = cache.Resolve(argv[0]);
+            int result = path == NULL
+                ? errno
+                : posix_spawn(&reply.pid, path, NULL, &attr,
+                      &argv[0], environ);
+            if ((result == ENOENT || result == ENOTDIR)
+                && path != NULL && path != argv[0])
+            {
+                cache.Drop(argv[0]);
+                result = posix_spawnp(&reply.pid, argv[0], NULL, &attr,
+                    &argv[0], environ);
+            }
+
+            reply.type = result == 0 ? SPAWNED : FAILED;
+            reply.value = result;
+            send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
         }
+    }
+public:
+    Launcher() : fd(-1), pid(0) { }
+
+    // Forks helper, returns false on error
+    bool Start()
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1)
+            return false;
 
-        // fgets error handler
-        if (errno)
+        std::cout.flush();
+        pid = fork();
+        if (pid == -1)
+            return false;
+        if (pid == 0)
         {
-            std::cerr << "Error in reading file (Error " 
-                << errno << ": " << std::strerror(errno) << std::endl;
-            isValid = false;
+            close(fds[0]);
+            Serve(fds[1]);
         }
-        else {
-            isValid = true;
+        close(fds[1]);
+        fd = fds[0];
+        return true;
+    }
+
+    inline int Descriptor() const { return fd; }
+    inline bool HasExits() const { return !exits.empty(); }
+
+    // Starts command with arguments separated by '\0'
+    // Returns pid, -1 on error with errno set
+    int Spawn(uint32_t index, const char* args, size_t size)
+    {
+        iovec iov[2];
+        iov[0].iov_base = &index;
+        iov[0].iov_len = sizeof(index);
+        iov[1].iov_base = const_cast<char*>(args);
+        iov[1].iov_len = size;
+
+        msghdr msg = msghdr();
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1)
+            return -1;
+
+        // Helper replies in order, exits may come before the reply
+        Reply reply;
+        while (true)
+        {
+            ssize_t result = recv(fd, &reply, sizeof(reply), 0);
+            if (result != sizeof(reply))
+            {
+                errno = result == 0 ? EPIPE : errno;
+                return -1;
+            }
+            if (reply.type != EXITED)
+                break;
+            exits.push_back(reply);
+        }
+
+        if (reply.type == FAILED)
+        {
+            errno = reply.value;
+            return 0;
         }
-        delete[] line;
+        return reply.pid;
     }
-    
-    void Test(iterator from,
-        iterator to, int options = 0) const
+
+    // Gets next exit without waiting, returns false if there is none
+    bool Receive(Reply& reply)
     {
-        const_iterator jt;
-        for (jt = from; jt != to; ++jt)
-            (*jt)->Test(options, start_time);
+        if (!exits.empty())
+        {
+            reply = exits.front();
+            exits.pop_front();
+            return true;
+        }
+        return recv(fd, &reply, sizeof(reply), MSG_DONTWAIT)
+            == sizeof(reply);
     }
-    
-    inline bool IsValid() const { return isValid; }
-    
-    ~CommandList()
+
+    ~Launcher()
     {
-        const_iterator jt;
-        for ( jt = this->begin(); jt != this->end(); ++jt)
-            delete *jt;    
+        if (fd != -1)
+            close(fd);
+        if (pid > 0)
+            waitpid(pid, NULL, 0);
     }
 };
 
+/**
+ * Opens command source, FIFO is kept open for writers to come and go
+ * @param name file name, '-' is standard input
+ * @return descriptor or -1 on error
+ */
+int OpenInput(const char* name)
+{
+    if (!std::strcmp(name, "-"))
+        return STDIN_FILENO;
+
+    struct stat info;
+    if (stat(name, &info) == 0 && S_ISFIFO(info.st_mode))
+        return open(name, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+    return open(name, O_RDONLY | O_CLOEXEC);
+}
+
 /**
  * Entry point
  * @param argc
@@ -181,73 +1636,310 @@ public:
  */
 int main (int argc, char** argv)
 {
-    if (argc != 2)
+    static const option options[] = {
+        { "max-parallel", required_argument, NULL, 'j' },
+        { "journal", required_argument, NULL, 'J' },
+        { "launcher", no_argument, NULL, 'L' },
+        { "stats", no_argument, NULL, 's' },
+        { "quiet", no_argument, NULL, 'q' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    // 0 is unlimited
+    size_t max_parallel = 0;
+    const char* journal_file = NULL;
+    bool use_launcher = false;
+    bool print_stats = false;
+    bool quiet = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:J:Lsq", options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            max_parallel = strtoul(optarg, NULL, 0);
+            break;
+        case 'J':
+            journal_file = optarg;
+            break;
+        case 'L':
+            use_launcher = true;
+            break;
+        case 's':
+            print_stats = true;
+            break;
+        case 'q':
+            quiet = true;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (argc - optind != 1)
     {
         std::cerr << "Syntax error" << std::endl
-            << "The only parameter is the name of command file" << std::endl;
+            << "Usage: " << argv[0]
+            << " [--max-parallel N] [--journal FILE] [--launcher]"
+            << " [--stats] [--quiet] file" << std::endl
+            << "Use '-' for standard input. FIFO is kept open for writers"
+            << " to come and go" << std::endl
+            << "and is read until SIGINT or SIGTERM, which also cancel"
+            << " tasks not started yet" << std::endl
+            << "Line is 'delay [interval=S] [count=N] [jitter=S]"
+            << " [overlap=skip|queue|parallel] command [args]'"
+            << std::endl;
         return -1;
     }
+    const char* file = argv[optind];
+    TRACE_INIT("useless");
+
+    // Children exits, termination and timer expirations
+    // are delivered through descriptors
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    // Helper is forked while scheduler is still small
+    Launcher launcher;
+    if (use_launcher && !launcher.Start())
+    {
+        std::cerr << "Error in creating launcher (Error "
+            << errno << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    // Commands started by fork are resolved here, children use execv
+    PathCache paths;
+
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (sfd == -1 || tfd == -1)
+    {
+        std::cerr << "Error in creating event descriptors (Error "
+            << errno << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
 
-    FILE *fp = fopen(argv[1],"r");
-    if (fp == NULL)
+    // Default 50us timer slack is comparable with the jitter we measure
+    prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+
+    int in = OpenInput(file);
+    if (in == -1)
     {
-        std::cerr << "Error in opening '" << argv[1] <<"' (Error " 
+        std::cerr << "Error in opening '" << file <<"' (Error " 
                 << errno << ": " << std::strerror(errno) << std::endl;
         exit(EXIT_FAILURE);
     }
 
-    CommandList commands(fp);
-    fclose(fp);
-    
-    if (!commands.IsValid())
-        return 1;
+    Journal journal;
+    if (journal_file != NULL && !journal.Open(journal_file))
+    {
+        std::cerr << "Error in opening journal '" << journal_file
+            << "' (Error " << errno << ": " << std::strerror(errno)
+            << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    Stats stats(print_stats);
+    CommandList commands(&stats, journal_file != NULL ? &journal : NULL);
+    commands.SetQuiet(quiet);
+    commands.Recover(in);
 
-    commands.sort();
 
-    // Wait for time to run 1st program
-    sleep(commands.front()->getDelay());
-    for (CommandList::iterator it = commands.begin(); it != commands.end(); ++it)
+    bool interrupted = false;
+    while (in != -1 || !commands.IsIdle())
     {
-        int pid = fork();
-        if (pid == -1)    // Fork error handling
+        // Start everything which deadline has come while there are slots
+        int64_t now = Now();
+        commands.Promote(now);
+
+        int task;
+        while ((task = commands.Ready()) != -1
+            && (max_parallel == 0 || commands.Running() < max_parallel))
+        {
+            int64_t queued = commands.Queued(Now());
+
+            int pid;
+            const char* path;
+            if (use_launcher)
+            {
+                std::pair<const char*, size_t> args = commands.Arguments(task);
+                pid = launcher.Spawn(task, args.first, args.second);
+                if (pid == 0)
+                {
+                    std::cerr << "Error in executing process "
+                        << Command(commands, task)
+                        << "' (Error " << errno
+                        << ": " << std::strerror(errno) << std::endl;
+                    commands.Fail(127 << 8);
+                    continue;
+                }
+            }
+            else {
+                path = paths.Resolve(commands.Name(task));
+                if (path == NULL)
+                {
+                    std::cerr << "Error in executing process "
+                        << Command(commands, task)
+                        << "' (Error " << errno
+                        << ": " << std::strerror(errno) << std::endl;
+                    commands.Fail(127 << 8);
+                    continue;
+                }
+                pid = fork();
+            }
+
+            if (pid == -1)    // Fork error handling
+            {
+                std::cerr << "Error in creating process "
+                    << Command(commands, task)
+                    << "' (Error " << errno
+                    << ": " << std::strerror(errno) << std::endl;
+                return 1;
+            }
+            if (pid == 0) // Child
+            {
+                sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+                // Run
+                if (commands.Run(task, path) == -1)
+                {
+                    std::cerr << "Error in executing process "
+                        << Command(commands, task)
+                        << "' (Error " << errno
+                        << ": " << std::strerror(errno) << std::endl;
+                    _exit(1);
+                }
+            }
+
+            // Parent
+            now = Now();
+            int64_t late = commands.Late(now);
+            stats.Start(now, late, queued);
+
+            if (!quiet)
+            {
+                std::cout << "[Starting command " << Command(commands, task)
+                    << " (late " << late << " us";
+                if (max_parallel != 0)
+                    std::cout << ", queued " << queued << " us";
+                std::cout << ")]" << std::endl;
+            }
+            commands.Start(pid);
+        }
+
+        // Tasks which could not be started may leave nothing to wait for
+        if (in == -1 && commands.IsIdle())
+            break;
+
+        // Arm timer for the next deadline
+        itimerspec deadline = itimerspec();
+        int64_t next = commands.Next();
+        if (next != -1)
+        {
+            deadline.it_value.tv_sec = next / 1000000;
+            deadline.it_value.tv_nsec = next % 1000000 * 1000;
+        }
+        timerfd_settime(tfd, TFD_TIMER_ABSTIME, &deadline, NULL);
+
+        // Negative descriptors are ignored by poll
+        pollfd fds[4];
+        fds[0].fd = tfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = sfd;
+        fds[1].events = POLLIN;
+        fds[2].fd = in;
+        fds[2].events = POLLIN;
+        fds[3].fd = launcher.Descriptor();
+        fds[3].events = POLLIN;
+        for (size_t i = 0; i < 4; ++i)
+            fds[i].revents = 0;
+        if (!launcher.HasExits() && poll(fds, 4, -1) == -1 && errno != EINTR)
         {
-            std::cerr << "Error in creating process " << **it 
-                << "' (Error " << errno 
-                << ": " << std::strerror(errno) << std::endl;
+            std::cerr << "Error in waiting for events (Error "
+                << errno << ": " << std::strerror(errno) << std::endl;
             return 1;
         }
-        if (pid == 0) // Child
+
+        uint64_t expirations;
+        if (fds[0].revents & POLLIN)
+            while (read(tfd, &expirations, sizeof(expirations)) > 0);
+
+        if (fds[1].revents & POLLIN)
         {
-            std::cout << "[Starting command " << **it << "]" << std::endl;
+            signalfd_siginfo info;
+            bool reap = false;
+            while (read(sfd, &info, sizeof(info)) > 0)
+            {
+                if (info.ssi_signo == SIGCHLD)
+                {
+                    reap = true;
+                    continue;
+                }
+
+                // The first termination stops reading of new commands,
+                // drops everything not started and waits for running
+                // ones, the second one exits at once
+                if (interrupted)
+                {
+                    std::cerr << "[Terminated by signal " << info.ssi_signo
+                        << ", " << commands.Running()
+                        << " commands are left running]" << std::endl;
+                    return 1;
+                }
+                interrupted = true;
+                if (in != -1)
+                {
+                    close(in);
+                    in = -1;
+                }
+                size_t dropped = commands.Cancel();
+                std::cerr << "[Interrupted by signal " << info.ssi_signo
+                    << ", " << dropped << " tasks cancelled, waiting for "
+                    << commands.Running() << " running]" << std::endl;
+            }
+
+            // Check who has already finished
+            if (reap)
+                commands.Reap();
+        }
 
-            // Run
-            if ((*it)->Run() == -1)
+        // Exits of commands started by launcher
+        if (use_launcher)
+        {
+            if (fds[3].revents & POLLHUP)
             {
-                std::cerr << "Error in executing process " << **it 
-                    << "' (Error " << errno 
-                    << ": " << std::strerror(errno) << std::endl;
+                std::cerr << "Launcher has died" << std::endl;
                 return 1;
             }
 
-            return 0;
+            Launcher::Reply reply;
+            while (launcher.Receive(reply))
+                commands.Finish(reply.pid, reply.value);
         }
-        else { // Parent
-            (*it)->setId(pid);
 
-            // If process is not the last, sleep to time to run next
-            CommandList::iterator ct = it;
-            ++ct;
-            if (ct != commands.end())
-                sleep((*ct)->getDelay() - (*it)->getDelay());
-
-            // Check if anybody has already finished
-            // WNOHANG doesn't wait for finish
-            commands.Test(commands.begin(), it, WNOHANG);
+        // Tasks read now will be started on the next iteration
+        if (in != -1 && (fds[2].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            if (!commands.Read(in))
+            {
+                close(in);
+                in = -1;
+            }
         }
     }
 
-    // Wait for all processes
-    commands.Test(commands.begin(), commands.end());
+    stats.Summary(std::cout, max_parallel);
+    commands.Summary(std::cout);
+    if (print_stats)
+        stats.Report(std::cout);
 
-    return 0;
+    close(tfd);
+    close(sfd);
+    return commands.IsValid() && !interrupted ? 0 : 1;
 }